@@ -0,0 +1,350 @@
+//
+// Compact on-disk record of finished jobs so a picture can be drawn again without capturing or solving it
+//
+// Each job is one little-endian file:
+//   "DDTA", version, bitmap hash (64 bit), width, height, point count
+//   source crop size and JPEG bytes
+//   dithered bitmap, one bit per pixel, row by row (set for black)
+//   tour size and bytes: each point as the zigzag varint x then y step from the previous one
+// Neighboring points on a tour are mostly a pixel or two apart, so a point costs about two bytes.
+//
+#include "archive.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <fstream>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char archiveMagic[4] = { 'D', 'D', 'T', 'A' };
+static const uint32_t archiveVersion = 1;
+static const char* archiveSuffix = ".job";
+static const int sourceJpegQuality = 90;
+
+// bytes before the source crop
+static const size_t headerBytes = 4 + 4 + 8 + 4 + 4 + 4 + 4;
+
+static void put32(std::vector<uint8_t>& out, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static void put64(std::vector<uint8_t>& out, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const uint8_t* p)
+{
+	return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+// small steps either way become small numbers: 0, -1, 1, -2, 2 ... -> 0, 1, 2, 3, 4 ...
+static void putStep(std::vector<uint8_t>& out, int step)
+{
+	uint32_t v = ((uint32_t)step << 1) ^ (uint32_t)(step >> 31);
+	while (v >= 0x80)
+	{
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+static bool getStep(const uint8_t*& p, const uint8_t* end, int& step)
+{
+	uint32_t v = 0;
+	for (int shift = 0; shift < 35; shift += 7)
+	{
+		if (p == end)
+			return false;
+		uint8_t byte = *p++;
+		v |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			step = (int)(v >> 1) ^ -(int)(v & 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+// FNV-1a
+static uint64_t hashBytes(const uint8_t* p, size_t n, uint64_t h = 14695981039346656037ull)
+{
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ p[i]) * 1099511628211ull;
+	return h;
+}
+
+static std::string joinPath(const std::string& directory, const std::string& name)
+{
+	if (directory.empty())
+		return name;
+	return directory + "/" + name;
+}
+
+std::string archive_job(const std::string& directory, const cv::Mat& source, const cv::Size& size, const TourView& tour)
+{
+	// rebuild the dithered bitmap from the tour
+	const size_t bitmapBytes = ((size_t)size.width * size.height + 7) / 8;
+	std::vector<uint8_t> bitmap(bitmapBytes, 0);
+	for (const cv::Point& p : tour)
+	{
+		if (p.x < 0 || p.y < 0 || p.x >= size.width || p.y >= size.height)
+			throw std::runtime_error("archive_job point outside the bitmap");
+		size_t bit = (size_t)p.y * size.width + p.x;
+		bitmap[bit / 8] |= (uint8_t)(0x80 >> (bit % 8));
+	}
+
+	uint8_t dimensions[8];
+	for (int i = 0; i < 4; i++)
+	{
+		dimensions[i] = (uint8_t)((uint32_t)size.width >> (8 * i));
+		dimensions[4 + i] = (uint8_t)((uint32_t)size.height >> (8 * i));
+	}
+	const uint64_t key = hashBytes(bitmap.data(), bitmap.size(), hashBytes(dimensions, sizeof(dimensions)));
+
+	std::vector<uchar> jpeg;
+	if (!source.empty())
+		cv::imencode(".jpg", source, jpeg, { cv::IMWRITE_JPEG_QUALITY, sourceJpegQuality });
+
+	std::vector<uint8_t> steps;
+	steps.reserve(tour.size() * 2 + 16);
+	cv::Point last(0, 0);
+	for (const cv::Point& p : tour)
+	{
+		putStep(steps, p.x - last.x);
+		putStep(steps, p.y - last.y);
+		last = p;
+	}
+
+	std::vector<uint8_t> out;
+	out.reserve(headerBytes + jpeg.size() + bitmap.size() + 4 + steps.size());
+	out.insert(out.end(), archiveMagic, archiveMagic + 4);
+	put32(out, archiveVersion);
+	put64(out, key);
+	put32(out, (uint32_t)size.width);
+	put32(out, (uint32_t)size.height);
+	put32(out, (uint32_t)tour.size());
+	put32(out, (uint32_t)jpeg.size());
+	out.insert(out.end(), jpeg.begin(), jpeg.end());
+	out.insert(out.end(), bitmap.begin(), bitmap.end());
+	put32(out, (uint32_t)steps.size());
+	out.insert(out.end(), steps.begin(), steps.end());
+
+#ifdef _WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0755);
+#endif
+
+	// write it aside and rename it into place so a reader never sees half a file
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+	const std::string path = joinPath(directory, std::string(name) + archiveSuffix);
+	const std::string partial = path + ".part";
+
+	FILE* file = fopen(partial.c_str(), "wb");
+	if (!file)
+		throw std::runtime_error("archive_job can't create " + partial);
+	bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+	written = fclose(file) == 0 && written;
+#ifdef _WIN32
+	if (written)
+		remove(path.c_str());
+#endif
+	if (!written || rename(partial.c_str(), path.c_str()) != 0)
+	{
+		remove(partial.c_str());
+		throw std::runtime_error("archive_job can't write " + path);
+	}
+	return path;
+}
+
+std::vector<std::string> archived_jobs(const std::string& directory, size_t count)
+{
+	std::vector<std::pair<time_t, std::string>> jobs;
+
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t handle = _findfirst(joinPath(directory, std::string("*") + archiveSuffix).c_str(), &found);
+	if (handle != -1)
+	{
+		do
+		{
+			jobs.push_back({ found.time_write, joinPath(directory, found.name) });
+		} while (_findnext(handle, &found) == 0);
+		_findclose(handle);
+	}
+#else
+	const size_t suffixLength = strlen(archiveSuffix);
+	DIR* dir = opendir(directory.empty() ? "." : directory.c_str());
+	if (dir)
+	{
+		while (struct dirent* entry = readdir(dir))
+		{
+			std::string name(entry->d_name);
+			if (name.size() <= suffixLength || name.compare(name.size() - suffixLength, suffixLength, archiveSuffix) != 0)
+				continue;
+
+			std::string path = joinPath(directory, name);
+			struct stat info;
+			if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+				jobs.push_back({ info.st_mtime, path });
+		}
+		closedir(dir);
+	}
+#endif
+
+	// newest first
+	std::sort(jobs.begin(), jobs.end(), [](const std::pair<time_t, std::string>& a, const std::pair<time_t, std::string>& b) {
+		return a.first != b.first ? a.first > b.first : a.second > b.second;
+	});
+
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < jobs.size() && i < count; i++)
+		paths.push_back(jobs[i].second);
+	return paths;
+}
+
+ArchivedJob::ArchivedJob(const std::string& path)
+	: base(nullptr), length(0), key(0), count(0), sourceData(nullptr), sourceBytes(0), bitmapData(nullptr), tourData(nullptr), tourBytes(0)
+{
+#ifdef _WIN32
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("ArchivedJob can't open " + path);
+	contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	base = contents.data();
+	length = contents.size();
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("ArchivedJob can't open " + path);
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			base = (const uint8_t*)mapped;
+			length = (size_t)info.st_size;
+		}
+	}
+	close(fd);
+	if (!base)
+		throw std::runtime_error("ArchivedJob can't map " + path);
+#endif
+
+	// check every section fits before handing out pointers into the file
+	const uint8_t* end = base + length;
+	const uint8_t* p = base;
+	bool valid = length >= headerBytes && std::equal(archiveMagic, archiveMagic + 4, p) && get32(p + 4) == archiveVersion;
+	if (valid)
+	{
+		key = get64(p + 8);
+		bitmapSize = cv::Size((int)get32(p + 16), (int)get32(p + 20));
+		count = get32(p + 24);
+		sourceBytes = get32(p + 28);
+		p += headerBytes;
+
+		const uint64_t bitmapBytes = ((uint64_t)(uint32_t)bitmapSize.width * (uint32_t)bitmapSize.height + 7) / 8;
+		valid = bitmapSize.width > 0 && bitmapSize.height > 0 && (uint64_t)(end - p) >= (uint64_t)sourceBytes + bitmapBytes + 4;
+		if (valid)
+		{
+			sourceData = p;
+			bitmapData = sourceData + sourceBytes;
+			p = bitmapData + bitmapBytes;
+			tourBytes = get32(p);
+			tourData = p + 4;
+			valid = (uint64_t)(end - tourData) >= tourBytes;
+		}
+	}
+
+	if (!valid)
+	{
+		unmap();
+		throw std::runtime_error("ArchivedJob " + path + " isn't an archived job");
+	}
+}
+
+ArchivedJob::~ArchivedJob()
+{
+	unmap();
+}
+
+void ArchivedJob::unmap()
+{
+#ifndef _WIN32
+	if (base)
+		munmap((void*)base, length);
+#endif
+	base = nullptr;
+}
+
+cv::Mat ArchivedJob::source() const
+{
+	if (!sourceBytes)
+		return cv::Mat();
+	return cv::imdecode(cv::Mat(1, (int)sourceBytes, CV_8U, (void*)sourceData), cv::IMREAD_COLOR);
+}
+
+cv::Mat ArchivedJob::bitmap() const
+{
+	cv::Mat image(bitmapSize, CV_8U);
+	size_t bit = 0;
+	for (int y = 0; y < image.rows; y++)
+	{
+		uchar* row = image.ptr<uchar>(y);
+		for (int x = 0; x < image.cols; x++, bit++)
+			row[x] = (bitmapData[bit / 8] & (0x80 >> (bit % 8))) ? 0 : 255;
+	}
+	return image;
+}
+
+ArchivedJob::Cursor ArchivedJob::tour() const
+{
+	return Cursor(tourData, tourData + tourBytes, count, bitmapSize);
+}
+
+ArchivedJob::Cursor::Cursor(const uint8_t* data, const uint8_t* end, uint32_t count, const cv::Size& size)
+	: data(data), end(end), remaining(count), size(size), last(0, 0)
+{
+}
+
+bool ArchivedJob::Cursor::next(cv::Point& p)
+{
+	int dx, dy;
+	if (!remaining || !getStep(data, end, dx) || !getStep(data, end, dy))
+		return false;
+
+	// never hand the plotter a point off the page, whatever is in the file
+	cv::Point q(last.x + dx, last.y + dy);
+	if (q.x < 0 || q.y < 0 || q.x >= size.width || q.y >= size.height)
+	{
+		remaining = 0;
+		return false;
+	}
+
+	remaining--;
+	last = q;
+	p = q;
+	return true;
+}
@@ -0,0 +1,75 @@
+//
+// Compact on-disk record of finished jobs so a picture can be drawn again without capturing or solving it
+//
+
+#pragma once
+
+#include "rgb2tsp.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Store a finished job in directory, named after a hash of its dithered bitmap so the same picture
+// is only kept once. The bitmap is rebuilt from the tour, which visits every black pixel.
+// Returns the path of the file written, throws if it can't be written.
+extern std::string archive_job(const std::string& directory, const cv::Mat& source, const cv::Size& size, const TourView& tour);
+
+// the paths of the most recently archived jobs in directory, newest first
+extern std::vector<std::string> archived_jobs(const std::string& directory, size_t count);
+
+// An archived job mapped into memory. The tour is decoded as it is read, so drawing it
+// never needs more than the bytes the sender is looking at.
+class ArchivedJob
+{
+public:
+	// throws if the file can't be read or isn't an archived job
+	explicit ArchivedJob(const std::string& path);
+	~ArchivedJob();
+
+	uint64_t hash() const { return key; }
+	cv::Size size() const { return bitmapSize; }
+	size_t points() const { return count; }
+
+	// the captured crop and the dithered bitmap, decoded on demand
+	cv::Mat source() const;
+	cv::Mat bitmap() const;
+
+	// walks the tour one point at a time
+	class Cursor
+	{
+	public:
+		// the next point on the tour, returns false after the last one (or on a damaged file)
+		bool next(cv::Point& p);
+
+	private:
+		friend class ArchivedJob;
+		Cursor(const uint8_t* data, const uint8_t* end, uint32_t count, const cv::Size& size);
+
+		const uint8_t* data;
+		const uint8_t* end;
+		uint32_t remaining;
+		cv::Size size;
+		cv::Point last;
+	};
+	Cursor tour() const;
+
+private:
+	ArchivedJob(const ArchivedJob&) = delete;
+	ArchivedJob& operator=(const ArchivedJob&) = delete;
+	void unmap();
+
+	const uint8_t* base;
+	size_t length;
+#ifdef _WIN32
+	std::vector<uint8_t> contents;
+#endif
+
+	uint64_t key;
+	cv::Size bitmapSize;
+	uint32_t count;
+	const uint8_t* sourceData;
+	uint32_t sourceBytes;
+	const uint8_t* bitmapData;
+	const uint8_t* tourData;
+	uint32_t tourBytes;
+};
@@ -0,0 +1,131 @@
+//
+// Making everything behind the guest white, using the depth camera
+//
+#include "background.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BACKGROUND_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BACKGROUND_NEON
+#endif
+
+// Rows are handed to threads in bands at least this tall, less isn't worth starting a thread for
+const int backgroundBandRows = 64;
+
+uint16_t depth_limit(float clipping_dist, float depth_scale)
+{
+	if (!(depth_scale > 0) || !(clipping_dist > 0))
+		return 0;
+	if (clipping_dist / depth_scale >= UINT16_MAX)
+		return UINT16_MAX;
+
+	// step over any rounding in the division so the limit is exactly where depth_scale * depth passes clipping_dist
+	uint32_t limit = (uint32_t)floorf(clipping_dist / depth_scale);
+	while (limit > 0 && depth_scale * limit > clipping_dist)
+		limit--;
+	while (limit < UINT16_MAX && depth_scale * (limit + 1) <= clipping_dist)
+		limit++;
+	return (uint16_t)limit;
+}
+
+// 255 in mask for every pixel of the row that is background, 0 for the rest. depth - 1 wraps round to
+// 65535 for depth 0, so one unsigned compare catches unknown depths as well as those too far away.
+static void maskRow(const uint16_t* depth, int width, uint16_t limit, uint8_t* mask)
+{
+	int x = 0;
+#if defined(BACKGROUND_SSE2)
+	// SSE2 has no unsigned 16 bit compare, but limit - (depth - 1) saturates to 0 exactly when depth - 1 >= limit
+	const __m128i one = _mm_set1_epi16(1), bound = _mm_set1_epi16((short)limit), zero = _mm_setzero_si128();
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i a = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(depth + x)), one);
+		__m128i b = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(depth + x + 8)), one);
+		a = _mm_cmpeq_epi16(_mm_subs_epu16(bound, a), zero);
+		b = _mm_cmpeq_epi16(_mm_subs_epu16(bound, b), zero);
+		_mm_storeu_si128((__m128i*)(mask + x), _mm_packs_epi16(a, b));
+	}
+#elif defined(BACKGROUND_NEON)
+	const uint16x8_t one = vdupq_n_u16(1), bound = vdupq_n_u16(limit);
+	for (; x + 16 <= width; x += 16)
+	{
+		uint16x8_t a = vcgeq_u16(vsubq_u16(vld1q_u16(depth + x), one), bound);
+		uint16x8_t b = vcgeq_u16(vsubq_u16(vld1q_u16(depth + x + 8), one), bound);
+		vst1q_u8(mask + x, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+	}
+#endif
+	for (; x < width; x++)
+		mask[x] = (uint16_t)(depth[x] - 1) >= limit ? 255 : 0;
+}
+
+// the row mirrored into out, with the masked pixels made white by or-ing in the mask. For three or four
+// channels red is read from first and blue from last, which swaps them or not.
+static void mirrorRow(const uint8_t* color, const uint8_t* mask, int width, int channels, int first, int last, uint8_t* out)
+{
+	if (channels == 3)
+	{
+		uint8_t* o = out + 3 * (width - 1);
+		for (int x = 0; x < width; x++, color += 3, o -= 3)
+		{
+			const uint8_t m = mask[x];
+			o[0] = color[first] | m;
+			o[1] = color[1] | m;
+			o[2] = color[last] | m;
+		}
+	}
+	else if (channels == 1)
+	{
+		for (int x = 0; x < width; x++)
+			out[width - 1 - x] = color[x] | mask[x];
+	}
+	else
+	{
+		uint8_t* o = out + 4 * (width - 1);
+		for (int x = 0; x < width; x++, color += 4, o -= 4)
+		{
+			const uint8_t m = mask[x];
+			o[0] = color[first] | m;
+			o[1] = color[1] | m;
+			o[2] = color[last] | m;
+			o[3] = color[3] | m;
+		}
+	}
+}
+
+void mirror_foreground(const cv::Mat& color, const cv::Mat& depth, uint16_t limit, bool swapRB, cv::Mat& out, int threads)
+{
+	if (color.depth() != CV_8U || depth.type() != CV_16UC1)
+		throw std::runtime_error("[mirror_foreground] accepts only 8 bit color and 16 bit depth");
+	if (color.channels() != 1 && color.channels() != 3 && color.channels() != 4)
+		throw std::runtime_error("[mirror_foreground] accepts only gray, RGB/BGR or RGBA/BGRA color");
+	if (color.size() != depth.size())
+		throw std::runtime_error("[mirror_foreground] depth isn't aligned to color");
+
+	const int width = color.cols, height = color.rows, channels = color.channels();
+	const int first = swapRB && channels >= 3 ? 2 : 0;
+	const int last = swapRB && channels >= 3 ? 0 : 2;
+	out.create(color.size(), color.type());
+
+	auto band = [&](int from, int to)
+	{
+		std::vector<uint8_t> mask(width);
+		for (int y = from; y < to; y++)
+		{
+			maskRow(depth.ptr<uint16_t>(y), width, limit, mask.data());
+			mirrorRow(color.ptr<uint8_t>(y), mask.data(), width, channels, first, last, out.ptr<uint8_t>(y));
+		}
+	};
+
+	threads = std::max(1, std::min(threads, height / backgroundBandRows));
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++)
+		workers.push_back(std::thread(band, height * t / threads, height * (t + 1) / threads));
+	band(0, height / threads);
+	for (std::thread& worker : workers)
+		worker.join();
+}
@@ -0,0 +1,17 @@
+//
+// Making everything behind the guest white, using the depth camera
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+
+// The largest raw depth value (depth_scale meters a unit) that is no further away than clipping_dist meters,
+// so depths can be compared against it as they are instead of each one being converted to meters
+extern uint16_t depth_limit(float clipping_dist, float depth_scale);
+
+// Make out a copy of color mirrored left to right, with every pixel whose depth is 0 (unknown) or over limit
+// made white. color has 1, 3 or 4 channels (anything else throws) and depth is aligned to it, one uint16_t
+// a pixel. Red and blue are swapped if swapRB (to turn RGB into BGR). Every pixel is read and written once, with the rows split between threads.
+extern void mirror_foreground(const cv::Mat& color, const cv::Mat& depth, uint16_t limit, bool swapRB, cv::Mat& out, int threads);
@@ -0,0 +1,258 @@
+//
+// Converts pictures to TSP Art gcode files without the camera, the screen or the plotter, several at once,
+// so portraits can be made ahead of time, compared from one version to the next or made on a spare server
+//
+//   daguerreotype-batch [-j workers] [-s seconds] [-o directory] picture|directory ...
+//
+
+#include "rgb2tsp.h"
+#include "gcode.h"
+#include "settings.h"
+#include <opencv2/opencv.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Where the time for each picture went, written to this file in the output directory
+const char* timingsFile = "timings.csv";
+
+// What became of one picture
+struct Conversion
+{
+	std::string picture;
+	std::string gcode;
+	std::string error;
+	size_t points;
+	size_t moves;
+	double readSeconds, ditherSeconds, solveSeconds, gcodeSeconds;
+};
+
+static const std::atomic_bool not_cancelled(false);
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool isDirectory(const std::string& path)
+{
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+static bool isPicture(const std::string& name)
+{
+	std::string lower(name);
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+
+	static const char* suffixes[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff", ".webp", ".ppm", ".pgm" };
+	for (const char* suffix : suffixes)
+	{
+		const size_t length = strlen(suffix);
+		if (lower.size() > length && lower.compare(lower.size() - length, length, suffix) == 0)
+			return true;
+	}
+	return false;
+}
+
+// the name of the picture without its directory or extension
+static std::string baseName(const std::string& path)
+{
+	size_t start = path.find_last_of("/\\");
+	start = start == std::string::npos ? 0 : start + 1;
+	size_t end = path.find_last_of('.');
+	if (end == std::string::npos || end < start)
+		end = path.size();
+	return path.substr(start, end - start);
+}
+
+// scale the picture to fit the input size (keeping its shape), offset says where it goes to be centered.
+// Pictures then go on the same paper with the same pen as the ones captured in the booth.
+static cv::Mat fitPicture(const cv::Mat& picture, cv::Point& offset)
+{
+	const double scale = std::min((double)inputWidthPixels / picture.cols, (double)inputHeightPixels / picture.rows);
+	const cv::Size size(std::min(inputWidthPixels, std::max(1, (int)(picture.cols * scale + 0.5))),
+		std::min(inputHeightPixels, std::max(1, (int)(picture.rows * scale + 0.5))));
+	offset = cv::Point((inputWidthPixels - size.width) / 2, (inputHeightPixels - size.height) / 2);
+
+	if (size == picture.size())
+		return picture;
+	cv::Mat fitted;
+	cv::resize(picture, fitted, size, 0, 0, scale < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+	return fitted;
+}
+
+// turn one picture into a gcode file in directory, on whichever thread calls it, using up to threads threads
+static void convert(const std::string& picture, const std::string& directory, int seconds, int threads, Conversion& result)
+{
+	result.picture = picture;
+	result.gcode = directory + "/" + baseName(picture) + ".gcode";
+	result.points = result.moves = 0;
+	result.readSeconds = result.ditherSeconds = result.solveSeconds = result.gcodeSeconds = 0;
+
+	try
+	{
+		auto start = std::chrono::steady_clock::now();
+		cv::Mat image = cv::imread(picture);
+		if (image.empty())
+			throw std::runtime_error("[convert] can't read a picture from " + picture);
+		cv::Point offset;
+		image = fitPicture(image, offset);
+		result.readSeconds = secondsSince(start);
+
+		// stippling leaves the stipples in the image it's given, which is fine as it isn't needed again
+		start = std::chrono::steady_clock::now();
+		Path points = stipplePoints ? mat_to_stipples(image, stipplePoints, not_cancelled, nullptr, threads) : mat_to_points(image, not_cancelled, ditherKernel, nullptr, threads);
+		result.points = points.size();
+		result.ditherSeconds = secondsSince(start);
+		if (points.size() < 2)
+			throw std::runtime_error("[convert] " + picture + " has nothing to draw");
+
+		start = std::chrono::steady_clock::now();
+		Tour tour = points_to_tsp(points, not_cancelled, nullptr, seconds, nullptr, threads);
+		result.solveSeconds = secondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		FILE* file = fopen(result.gcode.c_str(), "w");
+		if (!file)
+			throw std::runtime_error("[convert] can't write " + result.gcode);
+		size_t i = 0;
+		PointSource next = [&](cv::Point& p)
+		{
+			if (i >= tour.size())
+				return false;
+			p = points[tour[i++]] + offset;
+			return true;
+		};
+		bool written = gcode_drawing(next, drawingLayout, [file](const char* line) { return fputs(line, file) >= 0; }, not_cancelled, nullptr, &result.moves);
+		if (fclose(file) != 0 || !written)
+		{
+			remove(result.gcode.c_str());
+			throw std::runtime_error("[convert] can't write " + result.gcode);
+		}
+		result.gcodeSeconds = secondsSince(start);
+	}
+	catch (const std::exception& e)
+	{
+		result.error = e.what();
+	}
+}
+
+static int usage()
+{
+	fprintf(stderr, "usage: daguerreotype-batch [-j workers] [-s seconds] [-o directory] picture|directory ...\n");
+	fprintf(stderr, "  -j  pictures to convert at once, sharing the cores between them (default: 1)\n");
+	fprintf(stderr, "  -s  seconds to improve each tour for (default: %d)\n", tourSeconds);
+	fprintf(stderr, "  -o  directory to write the gcode and %s to (default: the current one)\n", timingsFile);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) try
+{
+	int workers = 1;
+	int seconds = tourSeconds;
+	std::string directory = ".";
+	std::vector<std::string> pictures;
+
+	for (int a = 1; a < argc; a++)
+	{
+		if (strcmp(argv[a], "-j") == 0 && a + 1 < argc)
+			workers = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc)
+			seconds = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+			directory = argv[++a];
+		else if (argv[a][0] == '-')
+			return usage();
+		else if (isDirectory(argv[a]))
+		{
+			// every picture in the directory, in order of name
+			std::vector<cv::String> names;
+			cv::glob(std::string(argv[a]) + "/*", names, false);
+			for (const cv::String& name : names)
+				if (isPicture(name))
+					pictures.push_back(name);
+		}
+		else
+			pictures.push_back(argv[a]);
+	}
+	if (pictures.empty() || workers < 1 || seconds < 0)
+		return usage();
+
+#ifdef _WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0755);
+#endif
+
+	// each worker takes the next picture nobody has started on until there are none left. The cores are shared
+	// out between the workers rather than each one dithering and solving on all of them, as solving is time
+	// limited and a tour that has to share its cores comes out worse.
+	workers = std::min(workers, (int)pictures.size());
+	const int threads = std::max(1, (int)std::thread::hardware_concurrency() / workers);
+	printf("Converting %zu pictures, %d at a time on %d threads each\n", pictures.size(), workers, threads);
+	std::vector<Conversion> results(pictures.size());
+	std::atomic<size_t> started(0);
+	std::mutex output;
+	auto start = std::chrono::steady_clock::now();
+	auto work = [&]()
+	{
+		for (size_t i; (i = started++) < pictures.size(); )
+		{
+			convert(pictures[i], directory, seconds, threads, results[i]);
+
+			std::lock_guard<std::mutex> guard(output);
+			const Conversion& result = results[i];
+			if (result.error.empty())
+				printf("%s: %zu points, %zu moves in %.1f s\n", result.gcode.c_str(), result.points, result.moves,
+					result.readSeconds + result.ditherSeconds + result.solveSeconds + result.gcodeSeconds);
+			else
+				fprintf(stderr, "%s\n", result.error.c_str());
+		}
+	};
+	std::vector<std::thread> others;
+	for (int t = 1; t < workers; t++)
+		others.push_back(std::thread(work));
+	work();
+	for (std::thread& other : others)
+		other.join();
+	const double elapsed = secondsSince(start);
+
+	// the timings for every picture, and the totals
+	const std::string timings = directory + "/" + timingsFile;
+	FILE* file = fopen(timings.c_str(), "w");
+	if (!file)
+		throw std::runtime_error("[main] can't write " + timings);
+	fprintf(file, "picture,gcode,points,moves,threads,read_seconds,dither_seconds,solve_seconds,gcode_seconds,error\n");
+	size_t converted = 0;
+	double busy = 0;
+	for (const Conversion& result : results)
+	{
+		fprintf(file, "\"%s\",\"%s\",%zu,%zu,%d,%.3f,%.3f,%.3f,%.3f,\"%s\"\n", result.picture.c_str(), result.error.empty() ? result.gcode.c_str() : "",
+			result.points, result.moves, threads, result.readSeconds, result.ditherSeconds, result.solveSeconds, result.gcodeSeconds, result.error.c_str());
+		converted += result.error.empty() ? 1 : 0;
+		busy += result.readSeconds + result.ditherSeconds + result.solveSeconds + result.gcodeSeconds;
+	}
+	fclose(file);
+
+	printf("Converted %zu of %zu pictures in %.1f s (%.1f s of work), timings are in %s\n", converted, results.size(), elapsed, busy, timings.c_str());
+	return converted == results.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+catch (const std::exception& e)
+{
+	fprintf(stderr, "%s\n", e.what());
+	return EXIT_FAILURE;
+}
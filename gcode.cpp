@@ -1,9 +1,98 @@
+#include "gcode.h"
+#include "simplify.h"
+#include <stdio.h>
+
+bool gcode_drawing(PointSource& next, const GcodeLayout& layout, const std::function<bool(const char*)>& write,
+	const std::atomic_bool& cancelled, size_t* points, size_t* moves)
+{
+	char buf[256];
+	float x, y;
+	cv::Point point;
+	bool completed = false;
+	const float widthMM = layout.paperMM.width;
+	const cv::Point2f scale(widthMM / layout.pixels.width, layout.paperMM.height / layout.pixels.height);
+	Path window, simplified;
+	size_t read = 0, sent = 0;
+	bool more = true;
+
+	// initilizae grbl state
+	if (!write("$H\n"))	// run homing cycle
+		goto ErrorExit;
+	if (!write("G00 G91 G21 Z-5 F3000\n"))	// lift the pen
+		goto ErrorExit;
+	if (!write("G00 G91 G21 X10 Y-10 Z0 F3000\n"))	// move to 10mm x 10mm to avoid the limit switches while drawing
+		goto ErrorExit;
+	if (!write("G92 X0 Y0 Z0\n"))	// Change the current coordinates without moving
+		goto ErrorExit;
+	if (!write("G90\n"))	// use absolute coordinates from the program's origin
+		goto ErrorExit;
+	if (!write("G21\n"))	// programming in mm
+		goto ErrorExit;
+	if (!write("G1 F3000\n"))	// set a feed rate (determines move speed)
+		goto ErrorExit;
+	//	if (!write("$1=255\n"))	// tell motors to prevent moving when stationary (step idle delay)
+	//		goto ErrorExit;
+
+		// move to the first point in the TSP with the pen up then lower the pen
+		// I'm flipping the x and y axis to match my CNC machine orientation
+	if (!next(point))
+		goto ErrorExit;
+	x = (float)point.x * scale.x;
+	y = (float)point.y * scale.y;
+	sprintf(buf, "G1 X%f Y%f Z0\n", y, x - widthMM);
+	if (!write(buf))
+		goto ErrorExit;
+	if (!write("G1 Z5\n"))
+		goto ErrorExit;
+
+	// move from point to point in the TSP (the pen is already on the first one), leaving out
+	// the ones the pen would pass over anyway. Each window starts where the last one ended.
+	window.assign(1, point);
+	read = 1;
+	while (more)
+	{
+		while (window.size() < layout.simplifyWindow && (more = next(point)))
+		{
+			window.push_back(point);
+			read++;
+		}
+		simplified = simplify_path(window, scale, layout.penWidthMM / 2);
+
+		for (size_t i = 1; i < simplified.size(); i++)
+		{
+			// output each point as the next position to move to (invert the Y coordinate)
+			x = (float)simplified[i].x * scale.x;
+			y = (float)simplified[i].y * scale.y;
+			sprintf(buf, "G1 X%f Y%f Z5\n", y, x - widthMM);
+			if (!write(buf))
+				goto ErrorExit;
+			sent++;
+
+			// if we've been asked to cancel, bail out early
+			if (cancelled)
+				goto ErrorExit;
+		}
+		window.assign(1, window.back());
+	}
+	completed = true;
+
+ErrorExit:
+	// reset the CNC to a safe location
+//	write("$1=254\n");	// step idle delay, milliseconds
+	write("G00 G90 G21 Z0 F3000\n");	// lift the pen
+	write("G00 G90 G21 X10 Y-10 F3000\n");	// move to 10mm x 10mm to avoid the limit switches
+
+	if (points)
+		*points = read;
+	if (moves)
+		*moves = sent;
+	return completed;
+}
+
 // cheap hack to determine if building for raspberry pi
 #ifdef __arm__
-#include "gcode.h"
 #include <errno.h>
 #include <fcntl.h> 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
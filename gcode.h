@@ -1,9 +1,32 @@
 //
-// functions to transmit gcode to a serial device
+// functions to generate gcode and transmit it to a serial device
 //
 
 #pragma once
 
+#include "rgb2tsp.h"
+#include <atomic>
+#include <functional>
+
+// where the points of a drawing come from, one at a time, returns false after the last one
+typedef std::function<bool(cv::Point&)> PointSource;
+
+// How a picture is laid out on the paper: pixels fills paperMM, and points closer than half penWidthMM
+// to the line drawn without them are left out, looking at simplifyWindow points at a time
+struct GcodeLayout
+{
+	cv::Size pixels;
+	cv::Size2f paperMM;
+	float penWidthMM;
+	size_t simplifyWindow;
+};
+
+// Generate the gcode to draw the points, handing it to write a line at a time. Stops early if write returns
+// false or cancelled is set, but always finishes by lifting the pen and moving it out of the way. Returns
+// true if every point was written, and counts the points read and the moves written in points and moves.
+bool gcode_drawing(PointSource& next, const GcodeLayout& layout, const std::function<bool(const char*)>& write,
+	const std::atomic_bool& cancelled, size_t* points = nullptr, size_t* moves = nullptr);
+
 int gcode_open(const char *portname);
 int gcode_write(int fd, const char *gcode);
 void gcode_close(int fd);
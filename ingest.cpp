@@ -0,0 +1,171 @@
+//
+// Pictures dropped into a folder, picked up and decoded on a thread of their own so the render loop never
+// touches the disk for them
+//
+#include "ingest.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+// How often to look for new pictures where there's no inotify, and how long to wait for an event before
+// checking whether we've been stopped where there is
+const int ingestPollMilliseconds = 1000;
+const int ingestWaitMilliseconds = 200;
+
+static bool isPicture(const std::string& name)
+{
+	std::string lower(name);
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+
+	static const char* suffixes[] = { ".png", ".jpg", ".jpeg", ".bmp" };
+	for (const char* suffix : suffixes)
+	{
+		const size_t length = strlen(suffix);
+		if (lower.size() > length && lower.compare(lower.size() - length, length, suffix) == 0)
+			return true;
+	}
+	return false;
+}
+
+FolderIngest::FolderIngest(const std::string& directory)
+	: directory(directory.empty() ? "." : directory), stopping(false)
+{
+#ifdef _WIN32
+	_mkdir(this->directory.c_str());
+#else
+	mkdir(this->directory.c_str(), 0755);
+#endif
+	thread = std::thread(&FolderIngest::run, this);
+}
+
+FolderIngest::~FolderIngest()
+{
+	stopping = true;
+	thread.join();
+}
+
+bool FolderIngest::next(cv::Mat& image)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (pictures.empty())
+		return false;
+	image = pictures.front();
+	pictures.pop_front();
+	return true;
+}
+
+// decode the picture and put it at the back of the queue. If it can't be decoded it's left where it is,
+// to be tried again if it's written again (or on the next look round without inotify).
+void FolderIngest::take(const std::string& name)
+{
+	if (!isPicture(name))
+		return;
+
+	// scan() takes pictures written between the watch starting and it looking, whose events still follow
+	const std::string path = directory + "/" + name;
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return;
+
+	cv::Mat image = cv::imread(path);
+	if (image.empty())
+	{
+		fprintf(stderr, "Can't read a picture from %s\n", path.c_str());
+		return;
+	}
+
+	const std::string taken = path + ".bak";
+#ifdef _WIN32
+	remove(taken.c_str());
+#endif
+	rename(path.c_str(), taken.c_str());
+
+	std::lock_guard<std::mutex> guard(lock);
+	pictures.push_back(image);
+}
+
+// take every picture in the directory, in order of name
+void FolderIngest::scan()
+{
+	std::vector<std::string> names;
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t handle = _findfirst((directory + "/*").c_str(), &found);
+	if (handle != -1)
+	{
+		do
+		{
+			if (!(found.attrib & _A_SUBDIR))
+				names.push_back(found.name);
+		} while (_findnext(handle, &found) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR* dir = opendir(directory.c_str());
+	if (dir)
+	{
+		while (struct dirent* entry = readdir(dir))
+			names.push_back(entry->d_name);
+		closedir(dir);
+	}
+#endif
+	std::sort(names.begin(), names.end());
+	for (const std::string& name : names)
+		take(name);
+}
+
+void FolderIngest::run()
+{
+#ifdef __linux__
+	// watch before looking at what's there already so nothing written in between is missed
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd != -1 && inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) != -1)
+	{
+		scan();
+
+		// the events give the names of files finished being written or moved in
+		alignas(struct inotify_event) char events[4096];
+		while (!stopping)
+		{
+			struct pollfd ready = { fd, POLLIN, 0 };
+			if (poll(&ready, 1, ingestWaitMilliseconds) <= 0)
+				continue;
+
+			ssize_t length = read(fd, events, sizeof(events));
+			for (char* p = events; length > 0 && p < events + length; )
+			{
+				const struct inotify_event* event = (const struct inotify_event*)p;
+				if (event->len && !(event->mask & IN_ISDIR))
+					take(event->name);
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		close(fd);
+		return;
+	}
+	if (fd != -1)
+		close(fd);
+	fprintf(stderr, "Can't watch %s for pictures, looking every %d ms instead\n", directory.c_str(), ingestPollMilliseconds);
+#endif
+
+	while (!stopping)
+	{
+		scan();
+		for (int waited = 0; waited < ingestPollMilliseconds && !stopping; waited += ingestWaitMilliseconds)
+			std::this_thread::sleep_for(std::chrono::milliseconds(ingestWaitMilliseconds));
+	}
+}
@@ -0,0 +1,41 @@
+//
+// Pictures dropped into a folder, picked up and decoded on a thread of their own so the render loop never
+// touches the disk for them
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Watches directory (made if it isn't there) for pictures (.png, .jpg, .jpeg or .bmp) being written or moved
+// into it: with inotify on Linux, by looking every second elsewhere. Pictures already there when watching
+// starts are taken too. Each one is decoded, renamed with .bak on the end so it's only taken once and kept
+// until the render loop asks for it.
+class FolderIngest
+{
+public:
+	explicit FolderIngest(const std::string& directory);
+	~FolderIngest();
+
+	// render loop: the oldest picture not taken yet, returns false if there isn't one
+	bool next(cv::Mat& image);
+
+private:
+	FolderIngest(const FolderIngest&) = delete;
+	FolderIngest& operator=(const FolderIngest&) = delete;
+
+	void run();
+	void scan();
+	void take(const std::string& name);
+
+	const std::string directory;
+	std::mutex lock;
+	std::deque<cv::Mat> pictures;
+	std::atomic_bool stopping;
+	std::thread thread;
+};
@@ -19,9 +19,21 @@
 #include "rgb2tsp.h"
 #include "texture.h"
 #include "gcode.h"
+#include "settings.h"
+#include "archive.h"
+#include "tspjob.h"
+#include "printqueue.h"
+#include "background.h"
+#include "ingest.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <exception>
 #include <vector>
-#include <future>
 #ifdef RASPBERRYPI
 #include <unistd.h>
 #endif
@@ -37,79 +49,223 @@ using namespace cv;
 const int screenWidth = 800;
 const int screenHeight = 480;
 
-// The input width/height should be less than the screen and camera resolution
-const int inputWidthPixels = 640;
-const int inputHeightPixels = 480;
+// What to ask the camera for. Color comes at the input size, in the order OpenCV wants, so there is nothing
+// to crop or convert. Aligning depth to color costs about the same for every depth pixel, so depth comes at
+// a lower resolution; 424 x 240 makes it cheaper still but the edges of the guest get blockier. If the camera
+// can't do this it starts with its defaults.
+const int colorWidthPixels = inputWidthPixels;
+const int colorHeightPixels = inputHeightPixels;
+const int depthWidthPixels = 480;
+const int depthHeightPixels = 270;
+const int cameraFps = 30;
+
+// The speed send_gcode draws at (its F3000 feed rate), to estimate how long the print queue will take
+const float drawSpeedMMPerSecond = 3000 / 60.f;
+
+// Time between queued drawings to take the last one off and put in a new sheet
+const int paperChangeSeconds = 20;
 
-// Large Etch-A-Sketch screen size is 160 mm x 110 mm (600 x 420 pixels - roughly 3:2 ratio)
-// Printable area on 8.5" / 11" paper is 250 mm x 180 mm
-// The output width/height ratio should be the same as the input ratio to prevent warping the image
-const int outputWidthMM = 250;
-const int outputHeightMM = 187;
+// Start on the tour for the live picture before 'start' is pressed, so a guest standing still has their
+// picture ready straight away. Every speculateCheckFrames frames the live picture is dithered (off the render
+// thread) and the job started over if it's more than speculateDifference (see points_difference) from the
+// one the job has.
+// 'start' keeps the job if the captured picture is that close too. This keeps every core busy while waiting.
+const bool speculate = false;
+const int speculateCheckFrames = 15;
+const double speculateDifference = 0.01;
+
+// Where finished jobs are kept so they can be drawn again
+const char* archiveDirectory = "archive";
+
+// Pictures dropped in this folder are drawn as if they'd been captured (handy when trying to make a video)
+const char* ingestDirectory = "ingest";
 
 
 // constants for UI control placement and state
 const int window_gap = 5;
 const int slider_window_width = 80;
 const int button_window_width = 80;
+const int queue_window_height = 30;
 enum class program_modes { interactive, computing, ready, printing };
 
-// enable threads to be canceled
-std::atomic_bool cancellation_token = ATOMIC_VAR_INIT(true);
-std::atomic_bool thread_running = ATOMIC_VAR_INIT(false);
+// A camera frame ready to show: background removed and mirrored to make it easier to center yourself
+struct CapturedFrame
+{
+	Mat image;
+	Mat depth;		// the aligned depth colorized, also mirrored, if asked for
+};
+
+// Waits on the camera, aligns depth to color and removes the background on a thread of its own, handing
+// the latest frame to the render loop through a triple buffer. Frames the render loop doesn't get to are
+// dropped, and a slow camera never holds up drawing the screen.
+class FrameCapture
+{
+public:
+	explicit FrameCapture(rs2::pipeline& pipe);
+	~FrameCapture();
+
+	// stop the capture thread and wait for it, which has to be done before the pipeline is stopped
+	void stop();
+
+	// render loop: pick up the latest frame if there's a new one, returns true if so. Rethrows whatever
+	// stopped the capture thread.
+	bool update();
+	CapturedFrame& latest() { return frames.read_buffer(); }
+
+	// set by the render loop: pixels further away than this (in meters) are background, whether to
+	// colorize the depth too, and whether frames are wanted at all. While paused frames are still taken
+	// from the camera, so the first one after is fresh, but they're dropped without doing anything to them
+	// to leave the cores to the job.
+	std::atomic<float> clipping_dist;
+	std::atomic_bool want_depth;
+	std::atomic_bool paused;
+
+private:
+	void run(rs2::pipeline& pipe);
+
+	TripleBuffer<CapturedFrame> frames;
+	std::atomic_bool stopping;
+	std::atomic_bool failed;
+	std::exception_ptr error;
+	std::thread thread;
+};
+
+// A picture dithered on a thread of its own and compared with the points of the speculative job, so the
+// render loop only has to pick up the result. picture is the 'start' it was taken for, 0 for a live frame.
+struct SpeculationCheck
+{
+	Mat crop;
+	Path points;
+	double difference;
+	int picture;
+};
 
 // local helper functions
 float get_depth_scale(device dev);
 rs2_stream find_stream_to_align(const std::vector<stream_profile>& streams);
 bool profile_changed(const std::vector<stream_profile>& current, const std::vector<stream_profile>& prev);
-void remove_background(rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist);
+Mat remove_background(const rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist);
 void render_slider(rect location, float& clipping_dist);
-void render_buttons(rect location, rs2::pipeline& pipe, program_modes& mode);
-void* print_gcode(void* tsp);
+void render_buttons(rect location, rs2::pipeline& pipe, program_modes& mode, bool& reprint);
+Mat render_tsp(const TourView& tsp);
+void render_progress(rect location, const TspJob& job);
+void render_queue(rect location, PrintQueue& queue);
+int reprint_archived(size_t count);
+
+double drawing_seconds(PointSource& next);
+bool send_gcode(PointSource& next, const std::atomic_bool& cancelled);
+void* print_gcode(void* queue);
+SpeculationCheck check_speculation(Mat crop, Path reference, int picture);
+
+#ifdef RASPBERRYPI
+// Draws the print queue on a thread of its own. However main is left, the queue is stopped (giving up on
+// the drawing in progress) and the thread waited for before the queue can go away.
+class PrintThread
+{
+public:
+	explicit PrintThread(PrintQueue& queue)
+		: queue(queue)
+	{
+		int rc = pthread_create(&thread, NULL, print_gcode, (void*)&queue);
+		if (rc)
+			throw std::runtime_error("Error " + std::to_string(rc) + " creating gcode print thread.");
+	}
+
+	~PrintThread()
+	{
+		queue.stop();
+		pthread_join(thread, NULL);
+	}
+
+private:
+	PrintThread(const PrintThread&) = delete;
+	PrintThread& operator=(const PrintThread&) = delete;
+
+	PrintQueue& queue;
+	pthread_t thread;
+};
+#endif
 
 static void glfw_error_callback(int error, const char* description)
 {
 	fprintf(stderr, "Glfw Error %d: %s\n", error, description);
 }
 
-int main(int, char**) try
+int main(int argc, char** argv) try
 {
+	// draw archived jobs again without the camera or the UI
+	if (argc == 3 && strcmp(argv[1], "--reprint") == 0)
+		return reprint_archived(strtoul(argv[2], NULL, 10));
+	if (argc != 1)
+	{
+		fprintf(stderr, "usage: %s [--reprint N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	// Track the state of the program - what step are we currently in?
 	program_modes program_mode = program_modes::interactive;
 	bool process_image = false;
 	bool process_tsp = false;
 	bool output_gcode = false;
+	bool reprint = false;
+
+	// The black pixels of the captured image and the TSP we generate through them
+	Path points;
+	Tour tsp;
+	TourView tsp_view(points, tsp);
+
+	// Turns the captured image into points and a tour in the background, publishing better tours as it goes
+	JobExecutor executor;
+	std::shared_ptr<TspJob> job;
+
+	// The job started on a live frame before 'start' was pressed, the frame's dithered points to compare
+	// later frames with and how many frames ago that was checked. One picture at a time is checked against
+	// it in the background; deciding is set from 'start' until the check on the picture taken says whether
+	// to keep the job, and pictures counts the times 'start' was pressed to tell that check apart.
+	std::shared_ptr<TspJob> speculation;
+	Path speculation_points;
+	int speculation_frames = 0;
+	std::future<SpeculationCheck> check;
+	bool deciding = false;
+	int pictures = 0;
+
+	// Finished jobs waiting for the plotter, drawn one after another by the print thread while the
+	// next guests are captured
+	PrintQueue print_queue(paperChangeSeconds);
+#ifdef RASPBERRYPI
+	PrintThread print_thread(print_queue);
+#endif
 
-	// The TSP we generate for the captured image
-	Path tsp;
-
-	// the OpenCV image we will draw
-	Mat display_image, print_image;
-	GLuint display_texture;
+	// the OpenCV image we will draw, and the crop it came from to archive with the tour
+	Mat display_image, print_image, source_image;
+	GLuint display_texture, depth_texture;
+	Size depth_size;
 
-	// create OpenGL texture to use for caching image to be displayed
+	// create OpenGL textures to use for caching the images to be displayed
 	glGenTextures(1, &display_texture);
+	glGenTextures(1, &depth_texture);
 
 	// Create a pipeline to easily configure and start the camera
 	pipeline pipe;
 
-	// Calling pipeline's start() without any additional parameters will start the first device
-	// with its default streams.
-	// The start function returns the pipeline profile which the pipeline used to start the device
-	pipeline_profile profile = pipe.start();
-
-	// Each depth camera might have different units for depth pixels, so we get it here
-	// Using the pipeline's profile, we can retrieve the device that the pipeline uses
-	float depth_scale = get_depth_scale(profile.get_device());
+	// Start the first device with the streams we want, or its default streams if it doesn't have them
+	rs2::config config;
+	config.enable_stream(RS2_STREAM_COLOR, colorWidthPixels, colorHeightPixels, RS2_FORMAT_BGR8, cameraFps);
+	config.enable_stream(RS2_STREAM_DEPTH, depthWidthPixels, depthHeightPixels, RS2_FORMAT_Z16, cameraFps);
+	if (config.can_resolve(pipe))
+		pipe.start(config);
+	else
+	{
+		fprintf(stderr, "The camera can't stream %dx%d color and %dx%d depth at %d fps, using its defaults\n",
+			colorWidthPixels, colorHeightPixels, depthWidthPixels, depthHeightPixels, cameraFps);
+		pipe.start();
+	}
 
-	// Pipeline could choose a device that does not have a color stream
-	// If there is no color stream, choose to align depth to another stream
-	rs2_stream align_to = find_stream_to_align(profile.get_streams());
+	// Get frames from the camera and remove their backgrounds on a thread of its own
+	FrameCapture capture(pipe);
 
-	// Create a align object.
-	// align allows us to perform alignment of depth frames to others frames
-	// The "align_to" is the stream type to which we plan to align depth frames.
-	rs2::align align(align_to);
+	// Pick up pictures dropped in the ingest folder on a thread of its own
+	FolderIngest ingest(ingestDirectory);
 
 	// Define a variable for controlling the distance to clip (integer divide by 10 to get actual flot value)
 	float depth_clipping_distance = 1.f;
@@ -193,14 +349,50 @@ int main(int, char**) try
 		// Take dimensions of the window for rendering purposes
 		glfwGetWindowSize(window, &w, &h);
 
-		// attempt to load an image from disk (handy when trying to make a video)
-		// if the image is loaded, jump directly into the processing state
-		Mat disk_image = imread("digital-daguerreotype.png");
-		if (!disk_image.empty()) {
+		// only the camera screen needs frames from the camera
+		capture.paused = program_mode != program_modes::interactive;
+
+		// a picture dropped in the ingest folder jumps directly into the processing state, once whatever
+		// is being looked at has been finished with
+		Mat disk_image;
+		if (program_mode == program_modes::interactive && ingest.next(disk_image)) {
 			display_image = disk_image;
 			process_image = true;
 			program_mode = program_modes::computing;
-			rename("digital-daguerreotype.png", "digital-daguerreotype.png.bak");
+		}
+
+		// pick up the check on a picture once it's done. A live frame that has moved on from the speculative
+		// job's starts the job over, and the picture taken by 'start' keeps the job if it looks the same as
+		// the job's or starts a new one if not. Checks nobody wants any more are dropped.
+		if (check.valid() && check.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		{
+			SpeculationCheck result = check.get();
+			if (result.picture == 0 && program_mode == program_modes::interactive)
+			{
+				if (!speculation || result.difference > speculateDifference)
+				{
+					if (speculation)
+						speculation->cancel();
+					speculation = std::make_shared<TspJob>(result.crop, ditherKernel, stipplePoints, tourSeconds);
+					executor.submit(speculation);
+					speculation_points = std::move(result.points);
+				}
+			}
+			else if (result.picture == pictures && deciding)
+			{
+				if (result.difference <= speculateDifference)
+					job = speculation;
+				else
+				{
+					speculation->cancel();
+					job = std::make_shared<TspJob>(print_image, ditherKernel, stipplePoints, tourSeconds);
+					executor.submit(job);
+				}
+				speculation.reset();
+				speculation_frames = 0;
+				source_image = job->image();
+				deciding = false;
+			}
 		}
 
 		switch (program_mode)
@@ -208,70 +400,59 @@ int main(int, char**) try
 		case program_modes::interactive:
 		{
 			// cancel any background tasks as we're going to be capuring a new image
-			cancellation_token = true;
-
-			// we block the application until a frameset is available
-			frameset frameset = pipe.wait_for_frames();
-
-			// Since align is aligning depth to some other stream, we need to make sure that the stream was not changed
-			// after the call to wait_for_frames();
-			if (profile_changed(pipe.get_active_profile().get_streams(), profile.get_streams()))
+			if (job)
 			{
-				// If the profile was changed, update the align object, and also get the new device's depth scale
-				profile = pipe.get_active_profile();
-				align_to = find_stream_to_align(profile.get_streams());
-				align = rs2::align(align_to);
-				depth_scale = get_depth_scale(profile.get_device());
+				job->cancel();
+				job.reset();
 			}
+			deciding = false;
 
-			// Get processed aligned frame
-			auto processed = align.process(frameset);
-
-			// Trying to get both video and aligned depth frames
-			video_frame other_frame = processed.first(align_to);
-			depth_frame aligned_depth_frame = processed.get_depth_frame();
-
-			// If one of them is unavailable, continue iteration
-			if (!aligned_depth_frame || !other_frame)
+			// show the latest frame the capture thread has for us, or the last one again if it hasn't got a new one
+			capture.clipping_dist = depth_clipping_distance;
+			capture.want_depth = w >= 1024;
+			if (capture.update())
 			{
-				continue;
-			}
-
-			// Passing both frames to remove_background so it will "strip" the background
-			remove_background(other_frame, aligned_depth_frame, depth_scale, depth_clipping_distance);
-
-			// Convert the RealSense frame to an OpenCV matrix
-			display_image = frame_to_mat(other_frame);
+				CapturedFrame& frame = capture.latest();
+				display_image = frame.image;
+				display_texture = mat_to_gl_texture(display_image, display_texture);
+				if (!frame.depth.empty())
+				{
+					depth_texture = mat_to_gl_texture(frame.depth, depth_texture);
+					depth_size = frame.depth.size();
+				}
 
-			// we will need to process this image before printing
-			process_image = true;
+				// we will need to process this image before printing
+				process_image = true;
 
-			// mirror the image to make it easier to center yourself
-			flip(display_image, display_image, 1);
+				// check whether the guest has moved since the frame the speculative job is working on
+				if (speculate && !check.valid() && speculation_frames++ % speculateCheckFrames == 0)
+				{
+					Rect box(Point((display_image.cols - inputWidthPixels) / 2, (display_image.rows - inputHeightPixels) / 2), Size(inputWidthPixels, inputHeightPixels));
+					Mat crop;
+					flip(Mat(display_image, box), crop, 1);
+					check = std::async(std::launch::async, check_speculation, crop, speculation_points, 0);
+				}
+			}
 
-			// render the flipped foreground only image and cache it in an OpenGL texture
-			x = (w - other_frame.get_width()) / 2;
-			y = (h - other_frame.get_height()) / 2;
-			display_texture = mat_to_gl_texture(display_image, display_texture);
-			render_gl_texture(display_texture, { (float)x, (float)y, (float)other_frame.get_width(), (float)other_frame.get_height() });
+			// render the flipped foreground only image from its cached OpenGL texture
+			if (process_image)
+			{
+				x = (w - display_image.cols) / 2;
+				y = (h - display_image.rows) / 2;
+				render_gl_texture(display_texture, { (float)x, (float)y, (float)display_image.cols, (float)display_image.rows });
+			}
 
 			// if the screen is wide enough, display the depth map
-			if (w >= 1024)
+			if (w >= 1024 && depth_size.area())
 			{
 				// render the depth frame, as a picture-in-picture
 				x = (w - inputWidthPixels) / 2;
 				y = (h - inputHeightPixels) / 2;
 				rect pip_stream{ 0, 0, (float)inputWidthPixels / 2, (float)inputHeightPixels / 2 };
-				pip_stream = pip_stream.adjust_ratio({ static_cast<float>(aligned_depth_frame.get_width()),static_cast<float>(aligned_depth_frame.get_height()) });
+				pip_stream = pip_stream.adjust_ratio({ static_cast<float>(depth_size.width), static_cast<float>(depth_size.height) });
 				pip_stream.x = (float)x + inputWidthPixels + window_gap;
 				pip_stream.y = (float)y;
-
-				// Render depth (as picture in picture)
-				Mat depth_image;
-				rs2::colorizer c;
-				flip(frame_to_mat(c.process(aligned_depth_frame)), depth_image, 1);
-				display_texture = mat_to_gl_texture(depth_image, display_texture);
-				render_gl_texture(display_texture, pip_stream);
+				render_gl_texture(depth_texture, pip_stream);
 			}
 
 			// Start the Dear ImGui frame
@@ -288,8 +469,11 @@ int main(int, char**) try
 			// Using ImGui library to provide a slide controller to select the depth clipping distance
 			render_slider({ window_gap, window_gap, slider_window_width, (float)h - window_gap * 2 }, depth_clipping_distance);
 
+			// show what's waiting to be drawn along the bottom of the picture
+			render_queue({ (float)x, (float)y + inputHeightPixels - queue_window_height, (float)inputWidthPixels, queue_window_height }, print_queue);
+
 			// Using ImGui library to provide print/confirm/cancel buttons
-			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode);
+			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode, reprint);
 
 			// Rendering
 			ImGui::Render();
@@ -319,38 +503,80 @@ int main(int, char**) try
 				display_texture = mat_to_gl_texture(print_image, display_texture);
 				process_image = false;
 
-				// start converting cv:Mat to a vector of TSP points
-				cancellation_token = false;
 #ifdef _DEBUG
 				imshow("print image", print_image);
 #endif
-				// if the tsp is empty for some reason, try capturing a new image
-				tsp = mat_to_tsp(print_image, cancellation_token);
-				if (tsp.empty())
-					program_mode = program_modes::interactive;
+				// stop working on the previous image (without waiting for it) and start converting this one,
+				// unless the speculative job already has a head start on a picture that looks the same, which
+				// is checked in the background
+				if (job)
+				{
+					job->cancel();
+					job.reset();
+				}
+				pictures++;
+				if (speculation)
+					deciding = true;
 				else
+				{
+					job = std::make_shared<TspJob>(print_image, ditherKernel, stipplePoints, tourSeconds);
+					executor.submit(job);
+					source_image = job->image();
+				}
+				points = Path();
+				tsp.clear();
+				output_gcode = false;
+			}
+
+			// check the picture against the speculative job's once the last check is out of the way
+			if (deciding && !check.valid())
+				check = std::async(std::launch::async, check_speculation, print_image, speculation_points, pictures);
+
+			if (job)
+			{
+				// once the job has its points, show the quick preview and each better tour it finds
+				if (points.empty() && job->stage() >= JobStage::solving)
+				{
+					points = job->points();
+					output_gcode = points.size() >= 2;
+				}
+				if (!points.empty() && job->snapshots().update())
+				{
+					tsp = job->snapshots().read_buffer().order;
 					process_tsp = true;
+				}
+
+				// once the job is done, replace the preview with the shortest tour
+				if (job->finished())
+				{
+					if (!job->error().empty())
+						fprintf(stderr, "%s\n", job->error().c_str());
+					if (!job->tour().empty())
+					{
+						tsp = job->tour();
+						process_tsp = true;
+					}
+					job.reset();
+
+					// if there are no points for some reason, try capturing a new image
+					if (tsp.empty())
+						program_mode = program_modes::interactive;
+				}
 			}
 
 			// if we have a tsp to process
 			if (process_tsp)
 			{
 				// draw the TSP path as a series of lines to simulate what we'll be outputting
-				display_image = Mat(Size(inputWidthPixels, inputHeightPixels), CV_8UC3, Scalar(255, 255, 255));
-				for (Path::iterator i = tsp.begin(); i != tsp.end(); ++i)
-				{
-					auto j = i + 1;
-					if (j != tsp.end())
-						cv::line(display_image, *i, *j, cv::Scalar(0, 0, 0), 1);
-				}
+				display_image = render_tsp(tsp_view);
 
 				// convert the output to a texture we can use to paint
 				display_texture = mat_to_gl_texture(display_image, display_texture);
-
-				// we're ready to draw the image
-				program_mode = program_modes::ready;
 				process_tsp = false;
-				output_gcode = true;
+
+				// we're ready to draw the image once the shortest tour has replaced the preview
+				if (!job)
+					program_mode = program_modes::ready;
 			}
 
 			// render the cached OpenGL texture
@@ -363,8 +589,15 @@ int main(int, char**) try
 			ImGui_ImplGlfw_NewFrame();
 			ImGui::NewFrame();
 
+			// show how far the job has got over the top of the picture
+			if (job)
+				render_progress({ (float)x + window_gap, (float)y + window_gap, (float)inputWidthPixels, (float)inputHeightPixels }, *job);
+
+			// show what's waiting to be drawn along the bottom of the picture
+			render_queue({ (float)x, (float)y + inputHeightPixels - queue_window_height, (float)inputWidthPixels, queue_window_height }, print_queue);
+
 			// Using ImGui library to provide print/confirm/cancel buttons
-			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode);
+			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode, reprint);
 
 			// Rendering
 			ImGui::Render();
@@ -373,32 +606,64 @@ int main(int, char**) try
 
 		case program_modes::printing:
 		{
-			// output gcode for TSP
-			if (output_gcode)
+			// 'again' doesn't need the live picture, but 'draw' pressed straight after 'start' waits to find out
+			// which job is drawing the picture
+			if (speculation && !deciding)
 			{
-#ifdef RASPBERRYPI
-				// create a thread to output the gcode
-				pthread_t gcode_thread;
-				int rc;
-
-				// initialize thread flow control now so it's correct before the thread even starts
-				cancellation_token = false;
-				thread_running = true;
-				rc = pthread_create(&gcode_thread, NULL, print_gcode, (void*)&tsp);
-				if (rc)
+				speculation->cancel();
+				speculation.reset();
+				speculation_frames = 0;
+			}
+
+			// if 'draw' was pressed while still computing, stop the job and settle for the best tour so far
+			// (which is the preview if the solver has nothing to give us when cancelled)
+			if (job)
+			{
+				job->cancel();
+				if (job->finished())
 				{
-					fprintf(stderr, "Error %d creating gcode print thread.\n", rc);
-					thread_running = false;
-					program_mode = program_modes::interactive;
+					if (!job->tour().empty())
+					{
+						tsp = job->tour();
+						display_image = render_tsp(tsp_view);
+						display_texture = mat_to_gl_texture(display_image, display_texture);
+					}
+					job.reset();
 				}
-#endif
-				output_gcode = false;
 			}
 
-			// if the print thread has completed
-			if (!thread_running)
+			// put the picture (or the last archived one for 'again') on the print queue and get ready for the next
+			// guest. The queue is drawn from the archive, so the picture has to be archived to be drawn.
+			if (!job && !deciding)
 			{
-				// we're ready to start with a new  picture
+				try
+				{
+					std::string path;
+					if (reprint)
+					{
+						std::vector<std::string> jobs = archived_jobs(archiveDirectory, 1);
+						if (!jobs.empty())
+							path = jobs[0];
+					}
+					else if (output_gcode)
+						path = archive_job(archiveDirectory, source_image, Size(inputWidthPixels, inputHeightPixels), tsp_view);
+#ifdef RASPBERRYPI
+					if (!path.empty())
+					{
+						ArchivedJob archived(path);
+						ArchivedJob::Cursor cursor = archived.tour();
+						PointSource next = [&cursor](Point& p) { return cursor.next(p); };
+						print_queue.push(path, drawing_seconds(next));
+					}
+#endif
+				}
+				catch (const std::exception& e)
+				{
+					fprintf(stderr, "%s\n", e.what());
+				}
+
+				output_gcode = false;
+				reprint = false;
 				program_mode = program_modes::interactive;
 			}
 
@@ -413,7 +678,7 @@ int main(int, char**) try
 			ImGui::NewFrame();
 
 			// Using ImGui library to provide print/confirm/cancel buttons
-			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode);
+			render_buttons({ (float)w - window_gap - button_window_width, window_gap, button_window_width, (float)h - window_gap * 2 }, pipe, program_mode, reprint);
 
 			// Rendering
 			ImGui::Render();
@@ -439,9 +704,12 @@ int main(int, char**) try
 	ImGui::DestroyContext();
 
 	glDeleteTextures(1, &display_texture);
+	glDeleteTextures(1, &depth_texture);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
+	// the capture thread may be waiting on the pipeline, so it has to go first
+	capture.stop();
 	pipe.stop();
 	return 0;
 }
@@ -456,6 +724,94 @@ catch (const std::exception& e)
 	return EXIT_FAILURE;
 }
 
+FrameCapture::FrameCapture(rs2::pipeline& pipe)
+	: clipping_dist(1.f), want_depth(false), paused(false), stopping(false), failed(false), thread(&FrameCapture::run, this, std::ref(pipe))
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+	stop();
+}
+
+void FrameCapture::stop()
+{
+	stopping = true;
+	if (thread.joinable())
+		thread.join();
+}
+
+bool FrameCapture::update()
+{
+	if (failed)
+		std::rethrow_exception(error);
+	return frames.update();
+}
+
+void FrameCapture::run(rs2::pipeline& pipe) try
+{
+	pipeline_profile profile = pipe.get_active_profile();
+
+	// Each depth camera might have different units for depth pixels, so we get it here
+	// Using the pipeline's profile, we can retrieve the device that the pipeline uses
+	float depth_scale = get_depth_scale(profile.get_device());
+
+	// Pipeline could choose a device that does not have a color stream
+	// If there is no color stream, choose to align depth to another stream
+	rs2_stream align_to = find_stream_to_align(profile.get_streams());
+
+	// Create a align object.
+	// align allows us to perform alignment of depth frames to others frames
+	// The "align_to" is the stream type to which we plan to align depth frames.
+	rs2::align align(align_to);
+	rs2::colorizer colorizer;
+
+	while (!stopping)
+	{
+		// wait a little at a time so we notice being stopped
+		frameset frameset;
+		if (!pipe.try_wait_for_frames(&frameset, 100) || paused)
+			continue;
+
+		// Since align is aligning depth to some other stream, we need to make sure that the stream was not changed
+		// after the call to wait_for_frames();
+		if (profile_changed(pipe.get_active_profile().get_streams(), profile.get_streams()))
+		{
+			// If the profile was changed, update the align object, and also get the new device's depth scale
+			profile = pipe.get_active_profile();
+			align_to = find_stream_to_align(profile.get_streams());
+			align = rs2::align(align_to);
+			depth_scale = get_depth_scale(profile.get_device());
+		}
+
+		// Get processed aligned frame
+		auto processed = align.process(frameset);
+
+		// Trying to get both video and aligned depth frames
+		video_frame other_frame = processed.first(align_to);
+		depth_frame aligned_depth_frame = processed.get_depth_frame();
+
+		// If one of them is unavailable, continue iteration
+		if (!aligned_depth_frame || !other_frame)
+			continue;
+
+		// Passing both frames to remove_background so it will "strip" the background, converting the color frame
+		// to a mirrored OpenCV matrix as it goes. They go into new matrices every time as the render loop may
+		// still be holding on to the ones last in this slot.
+		CapturedFrame& frame = frames.write_buffer();
+		frame.image = remove_background(other_frame, aligned_depth_frame, depth_scale, clipping_dist);
+		frame.depth = Mat();
+		if (want_depth)
+			flip(frame_to_mat(colorizer.process(aligned_depth_frame)), frame.depth, 1);
+		frames.publish();
+	}
+}
+catch (...)
+{
+	error = std::current_exception();
+	failed = true;
+}
+
 float get_depth_scale(device dev)
 {
 	// Go over the device's sensors
@@ -522,36 +878,32 @@ bool profile_changed(const std::vector<stream_profile>& current, const std::vect
 	return false;
 }
 
-void remove_background(rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist)
+// the color frame with every pixel further away than clipping_dist meters (or of unknown depth) made white,
+// mirrored and in BGR order
+Mat remove_background(const rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist)
 {
-	const uint16_t* p_depth_frame = reinterpret_cast<const uint16_t*>(depth_frame.get_data());
-	uint8_t* p_other_frame = reinterpret_cast<uint8_t*>(const_cast<void*>(other_frame.get_data()));
-
-	int width = other_frame.get_width();
-	int height = other_frame.get_height();
-	int other_bpp = other_frame.get_bytes_per_pixel();
-
-	// Using OpenMP to try to parallelise the loop
-#pragma omp parallel for schedule(dynamic) 
-	for (int y = 0; y < height; y++)
+	const Size size(other_frame.get_width(), other_frame.get_height());
+	const Mat color(size, CV_8UC(other_frame.get_bytes_per_pixel()), const_cast<void*>(other_frame.get_data()), other_frame.get_stride_in_bytes());
+	const Mat depth(Size(depth_frame.get_width(), depth_frame.get_height()), CV_16UC1, const_cast<void*>(depth_frame.get_data()), depth_frame.get_stride_in_bytes());
+	// only formats that are whole bytes a channel can be mirrored as they are; YUYV and the like can't
+	bool rgb = false;
+	switch (other_frame.get_profile().format())
 	{
-		auto depth_pixel_index = y * width;
-		for (int x = 0; x < width; x++, ++depth_pixel_index)
-		{
-			// Get the depth value of the current pixel
-			auto pixels_distance = depth_scale * p_depth_frame[depth_pixel_index];
-
-			// Check if the depth value is invalid (<=0) or greater than the threashold
-			if (pixels_distance <= 0.f || pixels_distance > clipping_dist)
-			{
-				// Calculate the offset in other frame's buffer to current pixel
-				auto offset = depth_pixel_index * other_bpp;
-
-				// Set "background" pixel color to white
-				std::memset(&p_other_frame[offset], 255, other_bpp);
-			}
-		}
+	case RS2_FORMAT_RGB8:
+	case RS2_FORMAT_RGBA8:
+		rgb = true;
+		break;
+	case RS2_FORMAT_BGR8:
+	case RS2_FORMAT_BGRA8:
+	case RS2_FORMAT_Y8:
+		break;
+	default:
+		throw std::runtime_error("[remove_background] the color frame format is not supported");
 	}
+
+	Mat image;
+	mirror_foreground(color, depth, depth_limit(clipping_dist, depth_scale), rgb, image, std::max(1, (int)std::thread::hardware_concurrency()));
+	return image;
 }
 
 void render_slider(rect location, float& clipping_dist)
@@ -594,7 +946,7 @@ void render_slider(rect location, float& clipping_dist)
 	ImGui::End();
 }
 
-void render_buttons(rect location, rs2::pipeline& pipe, program_modes& program_mode)
+void render_buttons(rect location, rs2::pipeline& pipe, program_modes& program_mode, bool& reprint)
 {
 	const float button_width = location.w - 2 * window_gap;
 	const float button_height = location.h / 2 - 2 * window_gap;
@@ -631,18 +983,19 @@ void render_buttons(rect location, rs2::pipeline& pipe, program_modes& program_m
 		if (ImGui::IsItemHovered())
 			ImGui::SetTooltip("Click 'start' to capture the current image");
 #endif
-		break;
-
-	case program_modes::computing:
-		ImGui::SetCursorPos({ window_gap, window_gap });
-		if (ImGui::Button("cancel", { button_width, button_height }))
-			program_mode = program_modes::interactive;
+		ImGui::SetCursorPos({ window_gap, location.h / 2 + window_gap });
+		if (ImGui::Button("again", { button_width, button_height }))
+		{
+			program_mode = program_modes::printing;
+			reprint = true;
+		}
 #ifdef TOOLTIP
 		if (ImGui::IsItemHovered())
-			ImGui::SetTooltip("Click 'cancel' to choose a different image");
+			ImGui::SetTooltip("Click 'again' to draw the last picture again");
 #endif
 		break;
 
+	case program_modes::computing:
 	case program_modes::ready:
 		ImGui::SetCursorPos({ window_gap, window_gap });
 		if (ImGui::Button("cancel", { button_width, button_height }))
@@ -666,7 +1019,7 @@ void render_buttons(rect location, rs2::pipeline& pipe, program_modes& program_m
 			program_mode = program_modes::interactive;
 #ifdef TOOLTIP
 		if (ImGui::IsItemHovered())
-			ImGui::SetTooltip("Click 'cancel' to stop the current drawing and start over");
+			ImGui::SetTooltip("Click 'cancel' to leave this picture out of the print queue");
 #endif
 		break;
 	}
@@ -676,79 +1029,175 @@ void render_buttons(rect location, rs2::pipeline& pipe, program_modes& program_m
 	ImGui::End();
 }
 
+// draw the TSP path as a series of lines to simulate what we'll be outputting
+Mat render_tsp(const TourView& tsp)
+{
+	Mat image(Size(inputWidthPixels, inputHeightPixels), CV_8UC3, Scalar(255, 255, 255));
+	for (size_t i = 1; i < tsp.size(); i++)
+		cv::line(image, tsp[i - 1], tsp[i], cv::Scalar(0, 0, 0), 1);
+
+	return image;
+}
+
+// one line at the top left of location saying what the job is doing: how much of the image is dithered, or how
+// many rounds the solver has had and the length of its best tour
+void render_progress(rect location, const TspJob& job)
+{
+	const TspProgress& progress = job.progress();
+	char text[128];
+	if (job.stage() == JobStage::solving)
+		snprintf(text, sizeof(text), "solving: round %d, %.0f pixels long", progress.rounds.load(), progress.length.load());
+	else
+		snprintf(text, sizeof(text), "dithering: %d%%", progress.dithered.load());
+
+	ImGui::GetBackgroundDrawList()->AddText(ImVec2(location.x, location.y), ImColor(0, 0, 255), text);
+}
+
+// how many drawings are waiting for the plotter and when it will be done with them, with a button to
+// stop the one being drawn. Nothing is shown while the queue is empty.
+void render_queue(rect location, PrintQueue& queue)
+{
+	const size_t depth = queue.depth();
+	if (!depth)
+		return;
+
+	static const int flags = ImGuiWindowFlags_NoCollapse
+		| ImGuiWindowFlags_NoScrollbar
+		| ImGuiWindowFlags_NoSavedSettings
+		| ImGuiWindowFlags_NoTitleBar
+		| ImGuiWindowFlags_NoResize
+		| ImGuiWindowFlags_NoMove;
+
+	ImGui::SetNextWindowPos({ location.x, location.y });
+	ImGui::SetNextWindowSize({ location.w, location.h });
+	ImGui::Begin("queue", nullptr, flags);
+
+	const int eta = (int)queue.eta();
+	ImGui::Text("%zu to draw, done in %d:%02d", depth, eta / 60, eta % 60);
+	ImGui::SameLine();
+	if (ImGui::SmallButton("stop drawing"))
+		queue.cancelCurrent();
+#ifdef TOOLTIP
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Click 'stop drawing' to give up on the picture being drawn and go on to the next one");
+#endif
+	ImGui::End();
+}
+
+// draw the last count archived jobs, oldest first, without the camera or the UI
+int reprint_archived(size_t count)
+{
+	std::vector<std::string> jobs = archived_jobs(archiveDirectory, count);
+	if (jobs.empty())
+	{
+		fprintf(stderr, "No jobs archived in %s\n", archiveDirectory);
+		return EXIT_FAILURE;
+	}
 #ifdef RASPBERRYPI
+	for (auto job = jobs.rbegin(); job != jobs.rend(); ++job)
+	{
+		ArchivedJob archived(*job);
+		printf("Load paper for %s (%zu points) and press Enter\n", job->c_str(), archived.points());
+		if (getchar() == EOF)
+			return EXIT_FAILURE;
+
+		ArchivedJob::Cursor cursor = archived.tour();
+		PointSource next = [&cursor](Point& p) { return cursor.next(p); };
+		std::atomic_bool not_cancelled(false);
+		if (!send_gcode(next, not_cancelled))
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+#else
+	fprintf(stderr, "Drawing is only supported on the Raspberry Pi\n");
+	return EXIT_FAILURE;
+#endif
+}
+
+// about how many seconds drawing the points will take
+double drawing_seconds(PointSource& next)
+{
+	const Point2f scale((float)outputWidthMM / inputWidthPixels, (float)outputHeightMM / inputHeightPixels);
+	double length = 0;
+	Point last, point;
+	if (!next(last))
+		return 0;
+	while (next(point))
+	{
+		length += hypot((point.x - last.x) * scale.x, (point.y - last.y) * scale.y);
+		last = point;
+	}
+	return length / drawSpeedMMPerSecond;
+}
+
+// dither the crop and compare it with the points of the speculative job, on whichever thread calls it
+SpeculationCheck check_speculation(Mat crop, Path reference, int picture)
+{
+	static const std::atomic_bool not_cancelled(false);
+
+	SpeculationCheck result;
+	result.crop = crop;
+	result.points = mat_to_points(crop, not_cancelled, ditherKernel);
+	result.difference = points_difference(result.points, reference, crop.size());
+	result.picture = picture;
+	return result;
+}
+
+#ifdef RASPBERRYPI
+// draw the jobs on the print queue one after another, straight from the archive
 void* print_gcode(void* arg)
 {
-	Path* tsp = (Path*)arg;
+	PrintQueue& queue = *(PrintQueue*)arg;
+	std::string path;
+	while (queue.next(path))
+	{
+		bool completed = false;
+		try
+		{
+			ArchivedJob job(path);
+			ArchivedJob::Cursor cursor = job.tour();
+			const size_t count = job.points();
+			size_t sent = 0;
+			PointSource next = [&](Point& p) {
+				if (!cursor.next(p))
+					return false;
+				queue.progress(++sent, count);
+				return true;
+			};
+			completed = send_gcode(next, queue.cancelled());
+		}
+		catch (const std::exception& e)
+		{
+			fprintf(stderr, "%s\n", e.what());
+		}
+		queue.finished(completed);
+	}
+
+	// exit the thread cleanly
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// draw the points on the CNC machine, returns true if every point was sent (and it wasn't cancelled)
+bool send_gcode(PointSource& next, const std::atomic_bool& cancelled)
+{
 	const char* portname = "/dev/ttyUSB0";
-	int fd;
-	char buf[256], * p;
-	int len;
-	float x, y;
+	size_t points = 0, moves = 0;
 
 	// open the serial port to the CNC machine
-	fd = gcode_open(portname);
+	int fd = gcode_open(portname);
 	if (-1 == fd)
-		goto ErrorExit;
-
-	// initilizae grbl state
-	if (gcode_write(fd, "$H\n"))	// run homing cycle
-		goto ErrorExit;
-	if (gcode_write(fd, "G00 G91 G21 Z-5 F3000\n"))	// lift the pen
-		goto ErrorExit;
-	if (gcode_write(fd, "G00 G91 G21 X10 Y-10 Z0 F3000\n"))	// move to 10mm x 10mm to avoid the limit switches while drawing
-		goto ErrorExit;
-	if (gcode_write(fd, "G92 X0 Y0 Z0\n"))	// Change the current coordinates without moving
-		goto ErrorExit;
-	if (gcode_write(fd, "G90\n"))	// use absolute coordinates from the program's origin
-		goto ErrorExit;
-	if (gcode_write(fd, "G21\n"))	// programming in mm
-		goto ErrorExit;
-	if (gcode_write(fd, "G1 F3000\n"))	// set a feed rate (determines move speed)
-		goto ErrorExit;
-	//	if (gcode_write(fd, "$1=255\n"))	// tell motors to prevent moving when stationary (step idle delay)
-	//		goto ErrorExit;
-
-		// move to the first point in the TSP with the pen up then lower the pen
-		// I'm flipping the x and y axis to match my CNC machine orientation
-	x = (float)(*tsp)[0].x * outputWidthMM / inputWidthPixels;
-	y = (float)(*tsp)[0].y * outputHeightMM / inputHeightPixels;
-	sprintf(buf, "G1 X%f Y%f Z0\n", y, x - outputWidthMM);
-	if (gcode_write(fd, buf))
-		goto ErrorExit;
-	if (gcode_write(fd, "G1 Z5\n"))
-		goto ErrorExit;
-
-	// move from point to point in the TSP
-	for (Path::iterator i = (*tsp).begin(); i != (*tsp).end(); ++i)
-	{
-		// output each point as the next position to move to (invert the Y coordinate)
-		x = (float)(*i).x * outputWidthMM / inputWidthPixels;
-		y = (float)(*i).y * outputHeightMM / inputHeightPixels;
-		sprintf(buf, "G1 X%f Y%f Z5\n", y, x - outputWidthMM);
-		if (gcode_write(fd, buf))
-			goto ErrorExit;
-
-		// if we've been asked to cancel, bail out early
-		if (cancellation_token)
-			goto ErrorExit;
-	}
+		return false;
 
-ErrorExit:
-	// reset the CNC to a safe location
-//	if (gcode_write(fd, "$1=254\n"))	// step idle delay, milliseconds
-//		goto ErrorExit;
-	gcode_write(fd, "G00 G90 G21 Z0 F3000\n");	// lift the pen
-	gcode_write(fd, "G00 G90 G21 X10 Y-10 F3000\n");	// move to 10mm x 10mm to avoid the limit switches
+	bool completed = gcode_drawing(next, drawingLayout, [fd](const char* line) { return gcode_write(fd, line) == 0; }, cancelled, &points, &moves);
+	if (completed)
+		printf("Drew %zu points with %zu moves, simplifying the path saved %zu\n", points, moves, points - 1 - moves);
 
 	// give grbl enough time to complete these last commands before we
 	// close the port as it will abort any command in progress
 	sleep(2);
 	gcode_close(fd);
 
-	// exit the thread cleanly
-	thread_running = false;
-	pthread_exit(NULL);
-	return NULL;
+	return completed;
 }
 #endif
@@ -0,0 +1,114 @@
+//
+// Archived jobs waiting to be drawn, so the next guest can be captured and solved while the plotter draws
+//
+#include "printqueue.h"
+#include <algorithm>
+
+PrintQueue::PrintQueue(int gapSeconds)
+	: gap(gapSeconds), stopping(false), drawing(false), cancelling(false), sent(0), points(0), ready(std::chrono::steady_clock::now()), scale(1)
+{
+}
+
+void PrintQueue::push(const std::string& path, double seconds)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Entry entry = { path, seconds };
+		waiting.push_back(entry);
+	}
+	wake.notify_all();
+}
+
+bool PrintQueue::next(std::string& path)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		if (stopping)
+			return false;
+		if (!waiting.empty())
+		{
+			// leave time to change the paper since the last drawing
+			if (std::chrono::steady_clock::now() >= ready)
+				break;
+			wake.wait_until(guard, ready);
+		}
+		else
+			wake.wait(guard);
+	}
+
+	current = waiting.front();
+	waiting.pop_front();
+	drawing = true;
+	cancelling = false;
+	sent = 0;
+	points = 0;
+	started = std::chrono::steady_clock::now();
+	path = current.path;
+	return true;
+}
+
+void PrintQueue::progress(size_t sent, size_t points)
+{
+	this->points.store(points, std::memory_order_relaxed);
+	this->sent.store(sent, std::memory_order_relaxed);
+}
+
+void PrintQueue::finished(bool completed)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto now = std::chrono::steady_clock::now();
+
+	// only whole drawings say anything about how long drawings take, and one odd drawing shouldn't throw
+	// the estimates off too far
+	if (completed && current.seconds > 0)
+	{
+		double took = std::chrono::duration<double>(now - started).count();
+		scale = 0.75 * scale + 0.25 * (took / current.seconds);
+	}
+	drawing = false;
+	ready = now + gap;
+}
+
+void PrintQueue::cancelCurrent()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (drawing)
+		cancelling = true;
+}
+
+void PrintQueue::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		cancelling = true;
+	}
+	wake.notify_all();
+}
+
+size_t PrintQueue::depth()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return waiting.size() + (drawing ? 1 : 0);
+}
+
+double PrintQueue::eta()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto now = std::chrono::steady_clock::now();
+	double seconds = 0;
+	if (drawing)
+	{
+		const size_t total = points.load(std::memory_order_relaxed);
+		const double done = total ? std::min((double)sent.load(std::memory_order_relaxed) / total, 1.0) : 0;
+		seconds += (1 - done) * current.seconds * scale;
+	}
+	else if (!waiting.empty() && ready > now)
+		seconds += std::chrono::duration<double>(ready - now).count();
+	for (const Entry& entry : waiting)
+		seconds += entry.seconds * scale;
+	if (!waiting.empty())
+		seconds += (double)gap.count() * (waiting.size() - (drawing ? 0 : 1));
+	return seconds;
+}
@@ -0,0 +1,73 @@
+//
+// Archived jobs waiting to be drawn, so the next guest can be captured and solved while the plotter draws
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+
+// Jobs are drawn oldest first by one printer thread. The tours stay on disk (see archive.h) until they
+// are drawn, only their paths are kept here. How long the queue will take is estimated from how long each
+// job should take, scaled by how long the jobs drawn so far actually took compared to their estimates.
+class PrintQueue
+{
+public:
+	// wait gapSeconds after each drawing before starting the next, to take it off and put in a new sheet
+	explicit PrintQueue(int gapSeconds);
+
+	// add the archived job at path to the end of the queue, it should take about seconds to draw
+	void push(const std::string& path, double seconds);
+
+	// printer thread: wait for the next job to draw and take it off the queue. Returns false once stopped.
+	bool next(std::string& path);
+
+	// printer thread: set when the job being drawn is to be given up on, for the sender to watch
+	const std::atomic_bool& cancelled() const { return cancelling; }
+
+	// printer thread: sent of the points of the job being drawn have gone to the plotter. This is called for
+	// every point, so it doesn't take the lock.
+	void progress(size_t sent, size_t points);
+
+	// printer thread: the job being drawn is done, completed if it was drawn all the way through
+	void finished(bool completed);
+
+	// give up on the job being drawn, if there is one. It stays given up on until the printer thread takes the
+	// next job, however late the sender gets around to looking.
+	void cancelCurrent();
+
+	// give up on the job being drawn, wake the printer thread and have next() return false from now on
+	void stop();
+
+	// jobs waiting or being drawn
+	size_t depth();
+
+	// about how many seconds until every job in the queue is drawn
+	double eta();
+
+private:
+	struct Entry
+	{
+		std::string path;
+		double seconds;
+	};
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<Entry> waiting;
+	const std::chrono::seconds gap;
+	bool stopping;
+
+	bool drawing;
+	std::atomic_bool cancelling;
+	Entry current;
+	std::atomic<size_t> sent, points;
+	std::chrono::steady_clock::time_point started, ready;
+
+	// how long drawings take compared to their estimates
+	double scale;
+};
@@ -1,204 +1,1783 @@
 //
 // processing of RGB image into <vector> of points in TSP order
 //
-#include "imgui.h"
 #include "rgb2tsp.h"
-#include <fstream>
+#include "spatialgrid.h"
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+#if defined(USE_LINKERN) && !defined(_WIN32)
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
 
 using namespace cv;
 using namespace std;
 
-// returns a vector of pixel positions in src that exactly match the value val.
-std::vector<cv::Point> pixelValuePositions(const cv::Mat& src, uchar val)
+// ImageAdjust[image, {0,0.9}] - lighten the image to blow out the face highlights
+const double lightenGain = 2.25;
+
+// the threads to use when asked for threads (0 for one per core)
+static int coreThreads(int threads)
 {
-	std::vector<cv::Point> points;
+	return std::max(1, threads > 0 ? threads : (int)std::thread::hardware_concurrency());
+}
 
-	if (src.type() != CV_8U) 
+// Rows of a BGR image lightened and converted to grayscale, exactly as convertTo and cvtColor would make
+// them, without making the whole image. The gain and each channel's weight are folded into one table.
+class LightenedGray
+{
+public:
+	explicit LightenedGray(const cv::Mat& image)
+		: image(image)
 	{
-		throw std::runtime_error("pixelValuePositions accepts only grayscale image");
+		if (image.type() != CV_8UC3)
+		{
+			throw std::runtime_error("[LightenedGray] accepts only BGR image");
+		}
+		if (image.empty())
+		{
+			throw std::runtime_error("[LightenedGray] image is empty");
+		}
+		if (image.cols > PathMaxSize || image.rows > PathMaxSize)
+		{
+			throw std::runtime_error("[LightenedGray] image is too big for a Path");
+		}
+
+		// the weights cvtColor uses for 8 bit images, in 15 bit fixed point
+		for (int v = 0; v < 256; v++)
+		{
+			const int32_t lightened = cv::saturate_cast<uchar>(v * lightenGain);
+			blue[v] = lightened * 3735;
+			green[v] = lightened * 19235;
+			red[v] = lightened * 9798;
+		}
 	}
-	if (src.empty()) 
+
+	int rows() const { return image.rows; }
+	int cols() const { return image.cols; }
+
+	// columns from to to of row i, shifted left by shift
+	template <class T>
+	void row(int i, int from, int to, T* gray, int shift = 0) const
 	{
-		throw std::runtime_error("pixelValuePositions image is empty");
+		const uchar* in = image.ptr<uchar>(i) + 3 * from;
+		for (int j = from; j < to; j++, in += 3)
+			gray[j] = (T)(((blue[in[0]] + green[in[1]] + red[in[2]] + (1 << 14)) >> 15) << shift);
 	}
 
+private:
+	const cv::Mat& image;
+	int32_t blue[256], green[256], red[256];
+};
+
+// add the pixels of row i that were dithered black to points
+static inline void appendBlack(Path& points, const uchar* out, int i, int cols)
+{
+	for (int j = 0; j < cols; j++)
+		if (!out[j])
+			points.push_back({ j, i });
+}
+
+// Error diffusion halftoning
+// https://github.com/yunfuliu/pixkit/blob/master/modules/pixkit-image/src/halftoning.cpp
+//
+// Integer version: pixel values carry 4 fractional bits and only the rows the kernel reaches are kept.
+// Each kernel is a type listing its taps, so spreading the error is unrolled at compile time and takes one
+// multiply by a constant scale (a shift when the divisor is a power of two) and then a multiply (or shift)
+// by each weight. Near the edges the kernel is renormalized over the taps that are inside the image; that
+// only changes the scale, which is looked up by column there.
+const int FractionBits = 4;
+const int ScaleBits = 16;
+
+// (1 << ScaleBits) / divisor, or more when only the taps weighing inside (of the sum) are in the image
+static constexpr int32_t diffusionScale(int sum, int divisor, int inside)
+{
+	return inside ? (int32_t)((((int64_t)sum << (ScaleBits + 1)) / ((int64_t)divisor * inside) + 1) / 2) : 0;
+}
+
+// weight parts of the error go dx columns to the right and dy rows down
+template <int DX, int DY, int Weight>
+struct Tap
+{
+	enum { dx = DX, dy = DY, weight = Weight };
+};
+
+// The taps of a kernel, and the divisor of their weights. The weights may add up to less than the divisor
+// (Atkinson), in which case the rest of the error is dropped.
+template <int Divisor, class... Taps>
+struct ErrorKernel;
+
+template <int Divisor>
+struct ErrorKernel<Divisor>
+{
+	enum { divisor = Divisor, sum = 0, depth = 0, reach = 0 };
+
+	static inline void spread(int32_t* const*, int, int32_t) {}
+	static inline int inside(int, int, int) { return 0; }
+};
+
+template <int Divisor, class T, class... Rest>
+struct ErrorKernel<Divisor, T, Rest...>
+{
+	typedef ErrorKernel<Divisor, Rest...> Next;
+	enum
+	{
+		divisor = Divisor,
+		sum = T::weight + Next::sum,
+		depth = T::dy > (int)Next::depth ? T::dy : (int)Next::depth,	// rows down
+		reach = (T::dx < 0 ? -T::dx : T::dx) > (int)Next::reach ? (T::dx < 0 ? -T::dx : T::dx) : (int)Next::reach	// columns to either side
+	};
+
+	// add each tap's share of the error, unit is the error times the scale
+	static inline void spread(int32_t* const* row, int j, int32_t unit)
+	{
+		row[T::dy][j + T::dx] += (unit * T::weight + (1 << (ScaleBits - 1))) >> ScaleBits;
+		Next::spread(row, j, unit);
+	}
+
+	// the weight of the taps that land inside an image cols wide, from column j with rows more rows below it
+	static inline int inside(int j, int cols, int rows)
+	{
+		return (T::dy <= rows && j + T::dx >= 0 && j + T::dx < cols ? T::weight : 0) + Next::inside(j, cols, rows);
+	}
+};
+
+// Stucki (1981)
+typedef ErrorKernel<42,
+	Tap<1, 0, 8>, Tap<2, 0, 4>,
+	Tap<-2, 1, 2>, Tap<-1, 1, 4>, Tap<0, 1, 8>, Tap<1, 1, 4>, Tap<2, 1, 2>,
+	Tap<-2, 2, 1>, Tap<-1, 2, 2>, Tap<0, 2, 4>, Tap<1, 2, 2>, Tap<2, 2, 1>> StuckiKernel;
+
+// Atkinson: only spreads 6/8 of the error, which blows out light and dark areas
+typedef ErrorKernel<8,
+	Tap<1, 0, 1>, Tap<2, 0, 1>,
+	Tap<-1, 1, 1>, Tap<0, 1, 1>, Tap<1, 1, 1>,
+	Tap<0, 2, 1>> AtkinsonKernel;
+
+// Jarvis, Judice and Ninke (1976)
+typedef ErrorKernel<48,
+	Tap<1, 0, 7>, Tap<2, 0, 5>,
+	Tap<-2, 1, 3>, Tap<-1, 1, 5>, Tap<0, 1, 7>, Tap<1, 1, 5>, Tap<2, 1, 3>,
+	Tap<-2, 2, 1>, Tap<-1, 2, 3>, Tap<0, 2, 5>, Tap<1, 2, 3>, Tap<2, 2, 1>> JarvisJudiceNinkeKernel;
+
+// Floyd and Steinberg (1976)
+typedef ErrorKernel<16,
+	Tap<1, 0, 7>,
+	Tap<-1, 1, 3>, Tap<0, 1, 5>, Tap<1, 1, 1>> FloydSteinbergKernel;
+
+// threshold pixel j of the first row and spread its error over the rows below
+template <class Kernel>
+static inline void diffusePixel(int32_t* const* row, int j, int32_t scale, uchar* out)
+{
+	int32_t error;
+	if (row[0][j] >= (128 << FractionBits)) {
+		error = row[0][j] - (255 << FractionBits);	//error value
+		out[j] = 255;
+	}
+	else {
+		error = row[0][j];	//error value
+		out[j] = 0;
+	}
+
+	// copies of the row pointers the compiler can see aren't changed by the stores that spread the error
+	int32_t* r[Kernel::depth + 1];
+	for (int x = 0; x <= Kernel::depth; x++)
+		r[x] = row[x];
+	Kernel::spread(r, j, error * scale);
+}
+
+// threshold columns from to to of the first row. On rows where all of the kernel's rows are inside the image
+// the scale is a constant away from the sides, otherwise it is looked up by column.
+template <class Kernel>
+static inline void diffuseColumns(int32_t* const* row, int from, int to, int cols, const int32_t* scale, bool allRows, uchar* out)
+{
+	const int32_t Scale = diffusionScale(Kernel::sum, Kernel::divisor, Kernel::sum);
+	const int left = allRows ? std::min(std::max(from, (int)Kernel::reach), to) : to;
+	const int right = allRows ? std::max(left, std::min(to, cols - Kernel::reach)) : to;
+
+	for (int j = from; j < left; j++)
+		diffusePixel<Kernel>(row, j, scale[j], out);
+	for (int j = left; j < right; j++)
+		diffusePixel<Kernel>(row, j, Scale, out);
+	for (int j = right; j < to; j++)
+		diffusePixel<Kernel>(row, j, scale[j], out);
+}
+
+// the scale for each column, one table after another for each number of rows (1 to depth) the kernel has below it
+template <class Kernel>
+static std::vector<int32_t> diffusionScales(int cols)
+{
+	std::vector<int32_t> scales((size_t)Kernel::depth * cols);
+	for (int below = 1; below <= Kernel::depth; below++)
+		for (int j = 0; j < cols; j++)
+			scales[(size_t)(below - 1) * cols + j] = diffusionScale(Kernel::sum, Kernel::divisor, Kernel::inside(j, cols, below));
+	return scales;
+}
+
+// Dither the image a row at a time, adding the black pixels of each row to points as it is finished and
+// counting the rows done in progress
+template <class Kernel>
+static void errorDiffusion(const LightenedGray& src, Path& points, TspProgress* progress)
+{
+	const int Depth = Kernel::depth;
+	const int Reach = Kernel::reach;
+	const int rows = src.rows(), cols = src.cols();
+	const std::vector<int32_t> scales = diffusionScales<Kernel>(cols);
+
+	// rows i to i+Depth with room for the kernel to spill over the sides; what lands there is dropped
+	const int stride = cols + 2 * Reach;
+	std::vector<int32_t> buffer((size_t)(Depth + 1) * stride, 0);
+	int32_t* row[Depth + 1];
+	for (int x = 0; x <= Depth; x++)
+	{
+		row[x] = &buffer[(size_t)x * stride + Reach];
+		if (x < rows)
+			src.row(x, 0, cols, row[x], FractionBits);
+	}
+	std::vector<uchar> out(cols);
+
 	// processing
-	for (int i = 0; i < src.rows; i++) 
+	// This sets a bunch of pixels in the last row to black.
+	// Stop one row short to avoid this.
+	for (int i = 0; i < rows - 1; i++) {
+		const int below = std::min(Depth, rows - 1 - i);
+		diffuseColumns<Kernel>(row, 0, cols, cols, &scales[(size_t)(below - 1) * cols], below == Depth, out.data());
+		appendBlack(points, out.data(), i, cols);
+		if (progress)
+			progress->dithered = 100 * (i + 1) / rows;
+
+		// move down a row, the row that was just finished takes in the next row of the image
+		int32_t* done = row[0];
+		for (int x = 0; x < Depth; x++)
+			row[x] = row[x + 1];
+		row[Depth] = done;
+		std::fill(done - Reach, done + cols + Reach, 0);
+		if (i + Depth + 1 < rows)
+			src.row(i + Depth + 1, 0, cols, done, FractionBits);
+	}
+
+	// the last row keeps its (rounded) gray values, only the ones that round to black are points
+	for (int j = 0; j < cols; j++)
+		if (row[0][j] + (1 << (FractionBits - 1)) < (1 << FractionBits))
+			points.push_back({ j, rows - 1 });
+}
+
+// columns a row finishes between telling the rows below how far it has got
+const int wavefrontColumns = 64;
+
+// Error diffusion with the rows dealt out to threads in turn. A row only reaches a column once the row
+// above has finished the columns whose error lands there, plus as many again so that the two rows never
+// add to the same pixel at once. Each row says how far it has got through a counter, and the error is
+// gathered in a buffer the size of the image so rows can be any distance apart. The additions all happen,
+// in a different order, so the result is exactly what errorDiffusion gives. Each thread keeps the black
+// pixels of its rows, and they are put back in row order at the end. The rows finished are counted between
+// the threads for progress, which is only written when the percentage goes up.
+template <class Kernel>
+static void errorDiffusionWavefront(const LightenedGray& src, Path& points, int threads, TspProgress* progress)
+{
+	const int Depth = Kernel::depth;
+	const int Reach = Kernel::reach;
+	const int rows = src.rows(), cols = src.cols();
+	const std::vector<int32_t> scales = diffusionScales<Kernel>(cols);
+	threads = std::max(1, std::min(threads, rows - 1));
+
+	// the error that has reached each pixel, with Depth rows below the image and room for the kernel to
+	// spill over the sides; what lands there is dropped
+	const int stride = cols + 2 * Reach;
+	std::vector<int32_t> error((size_t)(rows + Depth) * stride, 0);
+	std::unique_ptr<std::atomic<int>[]> finished(new std::atomic<int>[rows]);
+	for (int i = 0; i < rows; i++)
+		finished[i] = 0;
+
+	// the black pixels each thread found, and how many of them are on each row
+	std::vector<Path> found(threads);
+	std::vector<uint32_t> rowPoints(rows, 0);
+	std::atomic<int> rowsDone(0);
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.push_back(std::thread([&, t]()
+			{
+				Path& mine = found[t];
+				mine.reserve((size_t)(rows / threads + 1) * cols);
+				std::vector<uchar> gray(cols), out(cols);
+
+				for (int i = t; i < rows - 1; i += threads)
+				{
+					const int below = std::min(Depth, rows - 1 - i);
+					const int32_t* scale = &scales[(size_t)(below - 1) * cols];
+					int32_t* row[Depth + 1];
+					for (int x = 0; x <= Depth; x++)
+						row[x] = &error[(size_t)(i + x) * stride + Reach];
+
+					for (int from = 0; from < cols; from += wavefrontColumns)
+					{
+						const int to = std::min(from + wavefrontColumns, cols);
+						if (i > 0)
+						{
+							const int ahead = std::min(to + 2 * Reach, cols);
+							while (finished[i - 1].load(std::memory_order_acquire) < ahead)
+								std::this_thread::yield();
+						}
+
+						// the row above is done with these pixels, add them to the error they got
+						src.row(i, from, to, gray.data());
+						for (int j = from; j < to; j++)
+							row[0][j] += (int32_t)gray[j] << FractionBits;
+						diffuseColumns<Kernel>(row, from, to, cols, scale, below == Depth, out.data());
+						finished[i].store(to, std::memory_order_release);
+					}
+
+					const size_t before = mine.size();
+					appendBlack(mine, out.data(), i, cols);
+					rowPoints[i] = (uint32_t)(mine.size() - before);
+
+					const int done = ++rowsDone;
+					if (progress && 100 * done / rows != 100 * (done - 1) / rows)
+						progress->dithered = 100 * done / rows;
+				}
+			}));
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	size_t total = 0;
+	for (const Path& mine : found)
+		total += mine.size();
+	points.reserve(points.size() + total + cols);
+	std::vector<size_t> next(threads, 0);
+	for (int i = 0; i < rows - 1; i++)
+	{
+		const Path& mine = found[i % threads];
+		size_t& first = next[i % threads];
+		points.append(mine, first, rowPoints[i]);
+		first += rowPoints[i];
+	}
+
+	// the last row keeps its (rounded) gray values, only the ones that round to black are points
+	std::vector<uchar> gray(cols);
+	src.row(rows - 1, 0, cols, gray.data());
+	const int32_t* last = &error[(size_t)(rows - 1) * stride + Reach];
+	for (int j = 0; j < cols; j++)
+		if (((int32_t)gray[j] << FractionBits) + last[j] + (1 << (FractionBits - 1)) < (1 << FractionBits))
+			points.push_back({ j, rows - 1 });
+}
+
+// side of the tileable blue noise threshold mask, and the fewest rows worth giving a thread of their own
+const int blueNoiseSize = 64;
+const int blueNoiseBandRows = 64;
+
+// Void and cluster (Ulichney 1993): rank every cell of a size x size torus so the cells ranked below any
+// threshold are spread out as evenly as possible, then scale the ranks to thresholds from 0 to 254.
+static std::vector<uchar> makeBlueNoise(int size)
+{
+	const int cells = size * size;
+	const float sigma = 1.5f;
+
+	// how much a point pushes on the cells around it, any offset on the torus is at most size / 2
+	std::vector<float> push(cells);
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			const int dx = std::min(x, size - x), dy = std::min(y, size - y);
+			push[y * size + x] = expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+		}
+	}
+
+	std::vector<uchar> on(cells, 0);
+	std::vector<float> energy(cells, 0.f);
+	auto toggle = [&](int c, bool set)
+	{
+		on[c] = set;
+		const float sign = set ? 1.f : -1.f;
+		const int cx = c % size, cy = c / size;
+		for (int y = 0; y < size; y++)
+		{
+			const float* p = &push[((y - cy + size) % size) * size];
+			float* e = &energy[y * size];
+			for (int x = 0; x < cx; x++)
+				e[x] += sign * p[x - cx + size];
+			for (int x = cx; x < size; x++)
+				e[x] += sign * p[x - cx];
+		}
+	};
+
+	// the point in the tightest cluster, and the emptiest cell
+	auto tightest = [&]()
+	{
+		int best = -1;
+		for (int c = 0; c < cells; c++)
+			if (on[c] && (best < 0 || energy[c] > energy[best]))
+				best = c;
+		return best;
+	};
+	auto emptiest = [&]()
+	{
+		int best = -1;
+		for (int c = 0; c < cells; c++)
+			if (!on[c] && (best < 0 || energy[c] < energy[best]))
+				best = c;
+		return best;
+	};
+
+	// start from points on a random tenth of the cells, moving them out of clusters into voids until
+	// the one taken out is put straight back
+	std::mt19937 random(1);
+	const int initial = cells / 10;
+	for (int placed = 0; placed < initial; )
+	{
+		const int c = (int)(random() % cells);
+		if (!on[c])
+		{
+			toggle(c, true);
+			placed++;
+		}
+	}
+	for (;;)
+	{
+		const int c = tightest();
+		toggle(c, false);
+		const int v = emptiest();
+		toggle(v, true);
+		if (v == c)
+			break;
+	}
+	const std::vector<uchar> startOn(on);
+	const std::vector<float> startEnergy(energy);
+
+	// rank the starting points by taking away the tightest cluster each time, then the rest of the cells
+	// by filling the emptiest void each time
+	std::vector<int> rank(cells);
+	for (int r = initial - 1; r >= 0; r--)
+	{
+		const int c = tightest();
+		toggle(c, false);
+		rank[c] = r;
+	}
+	on = startOn;
+	energy = startEnergy;
+	for (int r = initial; r < cells; r++)
 	{
-		for (int j = 0; j < src.cols; j++) 
+		const int v = emptiest();
+		toggle(v, true);
+		rank[v] = r;
+	}
+
+	std::vector<uchar> mask(cells);
+	for (int c = 0; c < cells; c++)
+		mask[c] = (uchar)(rank[c] * 255 / cells);
+	return mask;
+}
+
+// Ordered dithering against the blue noise mask tiled over the image. No pixel depends on any other, so rows
+// are split into bands for the threads and the comparisons are vectorized a mask row at a time.
+static void blueNoiseDither(const LightenedGray& src, Path& points, int threads)
+{
+	// made the first time it is needed, it doesn't depend on the image
+	static const std::vector<uchar> mask = makeBlueNoise(blueNoiseSize);
+
+	const int rows = src.rows(), cols = src.cols();
+	threads = std::max(1, std::min(threads, rows / blueNoiseBandRows));
+	std::vector<Path> found(threads);
+
+	auto band = [&](int t)
+	{
+		Path& mine = t ? found[t] : points;
+		std::vector<uchar> gray(cols);
+		for (int i = rows * t / threads; i < rows * (t + 1) / threads; i++)
 		{
-			if (src.ptr<unsigned char>(i)[j] == val) {
-				points.push_back({ j, i });
+			src.row(i, 0, cols, gray.data());
+			const uchar* threshold = &mask[(size_t)(i % blueNoiseSize) * blueNoiseSize];
+			for (int from = 0; from < cols; from += blueNoiseSize)
+			{
+				// the compiler only vectorizes this without checking whether the rows overlap if the result
+				// goes somewhere it can see they don't
+				uchar tile[blueNoiseSize];
+				const int count = std::min(blueNoiseSize, cols - from);
+				if (count == blueNoiseSize)
+				{
+					for (int j = 0; j < blueNoiseSize; j++)
+						tile[j] = gray[from + j] > threshold[j] ? 255 : 0;
+				}
+				else
+				{
+					for (int j = 0; j < count; j++)
+						tile[j] = gray[from + j] > threshold[j] ? 255 : 0;
+				}
+				for (int j = 0; j < count; j++)
+					if (!tile[j])
+						mine.push_back({ from + j, i });
 			}
 		}
+	};
+
+	// the first band goes straight into points, the others are added after it in order
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++)
+		workers.push_back(std::thread(band, t));
+	band(0);
+	for (std::thread& worker : workers)
+		worker.join();
+	for (int t = 1; t < threads; t++)
+		points.append(found[t], 0, found[t].size());
+}
+
+// Lighten the BGR image, convert it to grayscale, dither it with the kernel asked for on threads threads and
+// return the positions of its black pixels in raster order. Each row goes through every step in turn and its
+// black pixels are collected as soon as it is finished, so none of the images in between are ever made.
+// Error diffusion reports the rows done to progress as it goes.
+static Path ditherToPoints(const cv::Mat& image, DitherKernel kernel, int threads, TspProgress* progress)
+{
+	struct Ditherer
+	{
+		void (*serial)(const LightenedGray&, Path&, TspProgress*);
+		void (*wavefront)(const LightenedGray&, Path&, int, TspProgress*);
+	};
+
+	// in the order DitherKernel lists them
+	static const Ditherer kernels[] = {
+		{ errorDiffusion<StuckiKernel>, errorDiffusionWavefront<StuckiKernel> },
+		{ errorDiffusion<AtkinsonKernel>, errorDiffusionWavefront<AtkinsonKernel> },
+		{ errorDiffusion<JarvisJudiceNinkeKernel>, errorDiffusionWavefront<JarvisJudiceNinkeKernel> },
+		{ errorDiffusion<FloydSteinbergKernel>, errorDiffusionWavefront<FloydSteinbergKernel> },
+	};
+
+	const LightenedGray gray(image);
+	Path points;
+
+	// room for every pixel to be black, the pages past the last black pixel are never touched
+	points.reserve((size_t)gray.rows() * gray.cols());
+
+	if (kernel == DitherKernel::BlueNoise)
+		blueNoiseDither(gray, points, threads);
+	else if ((size_t)kernel < sizeof(kernels) / sizeof(kernels[0]))
+	{
+		const Ditherer& ditherer = kernels[(size_t)kernel];
+		if (threads > 1 && gray.rows() > 2)
+			ditherer.wavefront(gray, points, threads, progress);
+		else
+			ditherer.serial(gray, points, progress);
 	}
+	else
+		throw std::runtime_error("[ditherToPoints] unknown kernel");
 
 	return points;
 }
 
-// Stucki halftoning processing
-// https://github.com/yunfuliu/pixkit/blob/master/modules/pixkit-image/src/halftoning.cpp
-bool Stucki1981(const cv::Mat& src, cv::Mat& dst)
+// most rounds of Lloyd relaxation when stippling, and the average distance the points still move
+// (in pixels) at which they are considered settled
+const int stippleIterations = 40;
+const float stippleTolerance = 0.02f;
+
+// Stipple points bucketed by cell so each pixel can find the closest one quickly
+class StippleGrid
 {
-	//////////////////////////////////////////////////////////////////////////
-	// exception
-	if (src.type() != CV_8U)
+public:
+	StippleGrid(const std::vector<cv::Point2f>& sites, int width, int height)
+		: sites(sites)
 	{
-		throw std::runtime_error("[Stucki1981] accepts only grayscale image");
+		// about two points to a cell
+		cell = std::max(1.f, sqrtf(2.f * width * height / std::max<size_t>(sites.size(), 1)));
+		columns = (int)(width / cell) + 1;
+		rows = (int)(height / cell) + 1;
+
+		start.assign((size_t)columns * rows + 1, 0);
+		for (const cv::Point2f& p : sites)
+			start[cellOf(p) + 1]++;
+		for (size_t c = 1; c < start.size(); c++)
+			start[c] += start[c - 1];
+		items.resize(sites.size());
+		std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+		for (uint32_t i = 0; i < (uint32_t)sites.size(); i++)
+			items[fill[cellOf(sites[i])]++] = i;
 	}
-	if (src.empty())
+
+	// the closest point to pixel (x, y), searching out ring by ring until no closer point can be left
+	uint32_t nearest(int x, int y) const
 	{
-		throw std::runtime_error("[Stucki1981] image is empty");
+		const float px = x + 0.5f, py = y + 0.5f;
+		const int cx = std::min((int)(px / cell), columns - 1), cy = std::min((int)(py / cell), rows - 1);
+		uint32_t best = UINT32_MAX;
+		float bestDistance = HUGE_VALF;
+		for (int r = 0; r < std::max(columns, rows); r++)
+		{
+			for (int y0 = cy - r; y0 <= cy + r; y0++)
+			{
+				if (y0 < 0 || y0 >= rows)
+					continue;
+				// only the edge of the ring is new
+				const int step = (y0 == cy - r || y0 == cy + r) ? 1 : std::max(1, 2 * r);
+				for (int x0 = cx - r; x0 <= cx + r; x0 += step)
+				{
+					if (x0 < 0 || x0 >= columns)
+						continue;
+					const size_t c = (size_t)y0 * columns + x0;
+					for (uint32_t k = start[c]; k < start[c + 1]; k++)
+					{
+						const cv::Point2f& s = sites[items[k]];
+						float d = (s.x - px) * (s.x - px) + (s.y - py) * (s.y - py);
+						if (d < bestDistance)
+						{
+							bestDistance = d;
+							best = items[k];
+						}
+					}
+				}
+			}
+
+			// everything beyond this ring is at least r cells away
+			if (best != UINT32_MAX && bestDistance <= (r * cell) * (r * cell))
+				break;
+		}
+		return best;
+	}
+
+private:
+	const std::vector<cv::Point2f>& sites;
+	float cell;
+	int columns, rows;
+	std::vector<uint32_t> start;
+	std::vector<uint32_t> items;
+
+	size_t cellOf(const cv::Point2f& p) const
+	{
+		int x = std::min(std::max((int)(p.x / cell), 0), columns - 1);
+		int y = std::min(std::max((int)(p.y / cell), 0), rows - 1);
+		return (size_t)y * columns + x;
 	}
+};
+
+// Weighted Voronoi stippling (Secord 2002): place count points with darker parts of the grayscale image
+// getting more of them, then repeatedly move each point to the darkness weighted centroid of the pixels
+// closest to it. Rows are split between threads and each thread sums its own centroids.
+static Path stipple(const cv::Mat& gray, int count, int threads, const std::atomic_bool& cancelled, TspProgress* progress)
+{
+	Path points;
+	const int width = gray.cols, height = gray.rows;
 
-	/////////////////////////////////////////////////////////////////////////
-	const float ErrorKernel_Stucki[3][5] = {
-		0,	0,	0,	8,	4,
-		2,	4,	8,	4,	2,
-		1,	2,	4,	2,	1
+	// start by spreading the points over the darkness in raster order, jittered within their pixels
+	double total = 0;
+	for (int y = 0; y < height; y++)
+	{
+		const uchar* row = gray.ptr<uchar>(y);
+		for (int x = 0; x < width; x++)
+			total += 255 - row[x];
+	}
+	if (count <= 0 || total <= 0)
+		return points;
+
+	std::vector<cv::Point2f> sites;
+	sites.reserve(count);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> jitter(0.f, 1.f);
+	const double spacing = total / count;
+	double next = spacing / 2, sum = 0;
+	for (int y = 0; y < height && (int)sites.size() < count; y++)
+	{
+		const uchar* row = gray.ptr<uchar>(y);
+		for (int x = 0; x < width && (int)sites.size() < count; x++)
+		{
+			sum += 255 - row[x];
+			while (sum > next && (int)sites.size() < count)
+			{
+				sites.push_back(cv::Point2f(x + jitter(random), y + jitter(random)));
+				next += spacing;
+			}
+		}
+	}
+
+	threads = std::min(threads, height);
+	struct Centroids
+	{
+		std::vector<double> x, y, weight;
 	};
-	const int HalfSize = 2;
+	std::vector<Centroids> bands(threads);
 
-	// copy Input to RegImage
-	cv::Mat tdst1f = src.clone();
-	tdst1f.convertTo(tdst1f, CV_32FC1);
+	for (int iteration = 0; iteration < stippleIterations && !cancelled; iteration++)
+	{
+		StippleGrid grid(sites, width, height);
 
-	// processing
-	// This sets a bunch of pixels in the last row to black.
-	// Stop one row short to avoid this.
-	for (int i = 0; i < src.rows - 1; i++) {
-		for (int j = 0; j < src.cols; j++) {
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threads; t++)
+		{
+			workers.push_back(std::thread([&, t]()
+				{
+					Centroids& band = bands[t];
+					band.x.assign(sites.size(), 0);
+					band.y.assign(sites.size(), 0);
+					band.weight.assign(sites.size(), 0);
+					for (int y = height * t / threads; y < height * (t + 1) / threads; y++)
+					{
+						const uchar* row = gray.ptr<uchar>(y);
+						for (int x = 0; x < width; x++)
+						{
+							// white pixels don't pull on anything
+							const int darkness = 255 - row[x];
+							if (!darkness)
+								continue;
+							uint32_t i = grid.nearest(x, y);
+							band.x[i] += (double)darkness * (x + 0.5);
+							band.y[i] += (double)darkness * (y + 0.5);
+							band.weight[i] += darkness;
+						}
+					}
+				}));
+		}
+		for (std::thread& worker : workers)
+			worker.join();
 
-			float error;
-			if (tdst1f.ptr<float>(i)[j] >= 128) {
-				error = tdst1f.ptr<float>(i)[j] - 255;	//error value
-				tdst1f.ptr<float>(i)[j] = 255;
+		// move every point to its centroid, points with no dark pixels of their own stay where they are
+		double moved = 0;
+		for (size_t i = 0; i < sites.size(); i++)
+		{
+			double x = 0, y = 0, weight = 0;
+			for (const Centroids& band : bands)
+			{
+				x += band.x[i];
+				y += band.y[i];
+				weight += band.weight[i];
 			}
-			else {
-				error = tdst1f.ptr<float>(i)[j];	//error value
-				tdst1f.ptr<float>(i)[j] = 0;
+			if (weight <= 0)
+				continue;
+
+			cv::Point2f centroid((float)(x / weight), (float)(y / weight));
+			moved += sqrt((centroid.x - sites[i].x) * (centroid.x - sites[i].x) + (centroid.y - sites[i].y) * (centroid.y - sites[i].y));
+			sites[i] = centroid;
+		}
+		if (progress)
+			progress->dithered = 100 * (iteration + 1) / stippleIterations;
+		if (moved < stippleTolerance * sites.size())
+			break;
+	}
+
+	// one point per pixel, in raster order like pixelValuePositions
+	std::vector<bool> taken((size_t)width * height, false);
+	for (const cv::Point2f& s : sites)
+	{
+		int x = std::min(std::max((int)s.x, 0), width - 1);
+		int y = std::min(std::max((int)s.y, 0), height - 1);
+		taken[(size_t)y * width + x] = true;
+	}
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			if (taken[(size_t)y * width + x])
+				points.push_back({ x, y });
+
+	return points;
+}
+
+#ifdef USE_LINKERN
+// append n to out in decimal
+static void appendNumber(std::string& out, unsigned long n)
+{
+	char digits[24];
+	int count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n);
+	while (count)
+		out += digits[--count];
+}
+
+// parse the next unsigned number at or after p, returns false if there isn't one
+static bool parseNumber(const char*& p, const char* end, unsigned long& n)
+{
+	while (p < end && (*p < '0' || *p > '9'))
+		p++;
+	if (p == end)
+		return false;
+
+	n = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		n = n * 10 + (*p++ - '0');
+	return true;
+}
+
+// write the points out as a TSPLIB file in one go
+static void writeTsp(const std::string& path, const Path& points)
+{
+	std::string text;
+	text.reserve(128 + points.size() * 16);
+	text += "NAME: digital daguerreotype\n";
+	text += "TYPE : TSP\n";
+	text += "DIMENSION : ";
+	appendNumber(text, points.size());
+	text += "\nEDGE_WEIGHT_TYPE : EUC_2D\n";
+	text += "NODE_COORD_SECTION\n";
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		appendNumber(text, i + 1);
+		text += ' ';
+		appendNumber(text, points[i].x);
+		text += ' ';
+		appendNumber(text, points[i].y);
+		text += '\n';
+	}
+
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f)
+		throw std::runtime_error("error creating " + path);
+	size_t written = fwrite(text.data(), 1, text.size(), f);
+	fclose(f);
+	if (written != text.size())
+		throw std::runtime_error("error writing " + path);
+}
+
+// read a whole file into memory
+static bool readFile(const std::string& path, std::string& contents)
+{
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	contents.resize(size > 0 ? size : 0);
+	size_t read = fread(&contents[0], 1, contents.size(), f);
+	fclose(f);
+	return read == contents.size();
+}
+
+#ifdef _WIN32
+// a directory for this job's files
+static std::string makeJobDirectory()
+{
+	return ".";
+}
+
+static void removeJobDirectory(const std::string&)
+{
+}
+
+// Run linkern to completion. There's no way to stop it early here so cancelling has to wait.
+static bool runLinkern(const std::string& tspPath, const std::string& tourPath, int seconds, const std::atomic_bool&)
+{
+	std::string command = "linkern -Q -t " + to_string(seconds) + " -o " + tourPath + " " + tspPath;
+	if (system(command.c_str()))
+		throw std::runtime_error("error spawning linkern");
+	return true;
+}
+#else
+// A directory for this job's files. Use memory backed /dev/shm when we have it so nothing touches the SD card.
+static std::string makeJobDirectory()
+{
+	char shm[] = "/dev/shm/digital-daguerreotype-XXXXXX";
+	char tmp[] = "/tmp/digital-daguerreotype-XXXXXX";
+	if (mkdtemp(shm))
+		return shm;
+	if (mkdtemp(tmp))
+		return tmp;
+	throw std::runtime_error("error creating a directory for linkern");
+}
+
+static void removeJobDirectory(const std::string& directory)
+{
+	unlink((directory + "/tour.tsp").c_str());
+	unlink((directory + "/tour.tour").c_str());
+	rmdir(directory.c_str());
+}
+
+// Spawn linkern and wait for it to finish, killing it if we are cancelled. Returns false if it was killed.
+static bool runLinkern(const std::string& tspPath, const std::string& tourPath, int seconds, const std::atomic_bool& cancelled)
+{
+	std::string time = to_string(seconds);
+	const char* argv[] = { "linkern", "-Q", "-t", time.c_str(), "-o", tourPath.c_str(), tspPath.c_str(), NULL };
+	pid_t pid;
+
+	int error = posix_spawnp(&pid, "linkern", NULL, NULL, const_cast<char* const*>(argv), environ);
+	if (error)
+		throw std::runtime_error("error spawning linkern: " + std::string(strerror(error)));
+
+	for (;;)
+	{
+		int status;
+		pid_t done = waitpid(pid, &status, WNOHANG);
+		if (done == pid)
+		{
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				throw std::runtime_error("linkern failed");
+			return true;
+		}
+		if (done < 0 && errno != EINTR)
+			throw std::runtime_error("error waiting for linkern");
+
+		if (cancelled)
+		{
+			kill(pid, SIGKILL);
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+				;
+			return false;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+}
+#endif
+
+// Spawn Concorde to calculate tour between all pixels. linkern only hands back its final tour so there are
+// no snapshots to publish, and nothing to return if we're cancelled.
+Tour findShortestTour(const Path& points, int seconds, int, const std::atomic_bool& cancelled, TourSnapshots*, TspProgress*)
+{
+	Tour tour;
+	std::string directory = makeJobDirectory();
+	std::string tspPath = directory + "/tour.tsp";
+	std::string tourPath = directory + "/tour.tour";
+	std::string contents;
+
+	try
+	{
+		writeTsp(tspPath, points);
+		if (!runLinkern(tspPath, tourPath, seconds, cancelled) || !readFile(tourPath, contents))
+		{
+			removeJobDirectory(directory);
+			return tour;
+		}
+	}
+	catch (...)
+	{
+		removeJobDirectory(directory);
+		throw;
+	}
+	removeJobDirectory(directory);
+
+	// The tour file is a count line followed by one "from to length" line per edge, in tour order,
+	// so the tour is the list of points the edges start from.
+	const char* p = contents.data();
+	const char* end = p + contents.size();
+	unsigned long count, x, y, z;
+	std::vector<bool> seen(points.size(), false);
+	if (parseNumber(p, end, count) && parseNumber(p, end, z))
+	{
+		tour.reserve(count);
+		for (unsigned long i = 0; i < count; i++)
+		{
+			if (!parseNumber(p, end, x) || !parseNumber(p, end, y) || !parseNumber(p, end, z))
+				break;
+			if (x >= points.size() || seen[x])
+				throw std::runtime_error("linkern returned an invalid tour");
+
+			seen[x] = true;
+			tour.push_back((uint32_t)x);
+		}
+	}
+	if (tour.size() != points.size())
+		throw std::runtime_error("linkern returned an incomplete tour");
+
+	// linkern's tour is a loop, we don't need to draw the edge back to the start so leave out the longest edge
+	size_t longest = tour.size() - 1;
+	float longestLength = 0;
+	for (size_t i = 0; i < tour.size(); i++)
+	{
+		const cv::Point& a = points[tour[i]];
+		const cv::Point& b = points[tour[(i + 1) % tour.size()]];
+		float length = (float)((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y));
+		if (length > longestLength)
+		{
+			longestLength = length;
+			longest = i;
+		}
+	}
+	std::rotate(tour.begin(), tour.begin() + (longest + 1) % tour.size(), tour.end());
+
+	return tour;
+}
+
+#else
+// number of nearest neighbors considered for each point when looking for improving moves
+const int tourNeighbors = 8;
+
+// longest segment Or-opt will try to move to a better spot in the tour
+const int orOptMaxLength = 3;
+
+// threads improving the tour (0 uses every core), the fewest points worth giving a thread of its own
+// and how long they work on their stretch of the tour before it is split up differently
+const int tourThreads = 0;
+const int tourPointsPerThread = 2000;
+const int tourRoundMilliseconds = 250;
+
+// Large point sets get their starting tour built from tiles solved in parallel, roughly this many points per tile
+const int tourPointsPerTile = 4000;
+
+// euclidean distance between points a and b, straight from the coordinate arrays
+static inline float pixelDistance(const int16_t* x, const int16_t* y, uint32_t a, uint32_t b)
+{
+	float dx = (float)(x[a] - x[b]);
+	float dy = (float)(y[a] - y[b]);
+	return sqrtf(dx * dx + dy * dy);
+}
+
+// Nearest neighbor heuristic: start at first (the top left corner by default) and keep walking to the closest
+// pixel we haven't visited yet. If last is given the walk leaves it for the very end.
+static Tour nearestNeighborTour(const Path& points, SpatialGrid& grid, uint32_t first = 0, uint32_t last = UINT32_MAX)
+{
+	Tour order;
+	order.reserve(points.size());
+
+	if (last == first)
+		last = UINT32_MAX;
+	if (last != UINT32_MAX)
+		grid.remove(last);
+
+	uint32_t current = first;
+	while (current != UINT32_MAX)
+	{
+		order.push_back(current);
+		grid.remove(current);
+		current = grid.nearest(points[current]);
+	}
+	if (last != UINT32_MAX)
+		order.push_back(last);
+
+	return order;
+}
+
+// The tour being improved. Optimizers working in parallel each own the points in their stretch of it.
+struct TourState
+{
+	const Path& points;
+	const std::vector<uint32_t>& neighbors;
+	Tour& order;
+	std::vector<uint32_t> pos;
+	std::vector<int> owner;
+
+	TourState(const Path& points, const std::vector<uint32_t>& neighbors, Tour& order)
+		: points(points), neighbors(neighbors), order(order), pos(order.size())
+	{
+		for (size_t i = 0; i < order.size(); i++)
+			pos[order[i]] = (uint32_t)i;
+	}
+};
+
+// Local search over the stretch of the tour between positions first and last, which stay where they are.
+// Every improving move is built from segment reversals so a failed perturbation can be undone by
+// replaying them backwards.
+class TourOptimizer
+{
+public:
+	TourOptimizer(TourState& tour, int first, int last, int id = 0, unsigned seed = 1)
+		: points(tour.points), neighbors(tour.neighbors), order(tour.order), pos(tour.pos), owner(tour.owner),
+		first(first), last(last), id(id), queued(tour.order.size(), false), length(0), logging(false), random(seed)
+	{
+		for (int i = first; i < last; i++)
+			length += dist(order[i], order[i + 1]);
+	}
+
+	// 2-opt and Or-opt until no improving move is left, then iterated kicks until time runs out
+	void optimize(std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled)
+	{
+		if (last - first < 4)
+			return;
+
+		if (!localSearch(deadline, cancelled))
+			return;
+
+		// Perturb a small stretch of the tour with a double bridge, repair it with local search and keep
+		// the result only if it is shorter. This is what lets us climb out of 2-opt/Or-opt local minima.
+		for (unsigned kicks = 0; ; kicks++)
+		{
+			if (cancelled)
+				return;
+			if ((kicks & 15) == 0 && std::chrono::steady_clock::now() >= deadline)
+				return;
+
+			double before = length;
+			undo.clear();
+			logging = true;
+			kick();
+			bool finished = improveQueued(deadline, cancelled);
+			logging = false;
+			if (length < before - 1e-3)
+				continue;
+
+			// not an improvement, put things back the way they were
+			for (auto u = undo.rbegin(); u != undo.rend(); ++u)
+				reverse(u->first, u->second);
+			length = before;
+			clearQueue();
+			if (!finished)
+				return;
+		}
+	}
+
+	// improve only until there are no more improving moves, returns false if we ran out of time first
+	bool localSearch(std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled)
+	{
+		for (int i = first; i <= last; i++)
+			push(order[i]);
+		return improveQueued(deadline, cancelled);
+	}
+
+private:
+	const Path& points;
+	const std::vector<uint32_t>& neighbors;
+	Tour& order;
+	std::vector<uint32_t>& pos;
+	const std::vector<int>& owner;
+	const int first, last, id;
+	std::vector<uint32_t> work;
+	std::vector<bool> queued;
+	std::vector<std::pair<int, int>> undo;
+	double length;
+	bool logging;
+	std::mt19937 random;
+
+	float dist(uint32_t a, uint32_t b) const
+	{
+		return pixelDistance(points.x(), points.y(), a, b);
+	}
+
+	// only points in our own stretch of the tour may be looked up or moved
+	bool owns(uint32_t node) const
+	{
+		return owner.empty() || owner[node] == id;
+	}
+
+	void push(uint32_t node)
+	{
+		if (!queued[node])
+		{
+			queued[node] = true;
+			work.push_back(node);
+		}
+	}
+
+	void clearQueue()
+	{
+		for (uint32_t node : work)
+			queued[node] = false;
+		work.clear();
+	}
+
+	// reverse the tour between positions i and j inclusive
+	void reverse(int i, int j)
+	{
+		if (logging)
+			undo.push_back(std::make_pair(i, j));
+		for (; i < j; i++, j--)
+		{
+			uint32_t a = order[i], b = order[j];
+			order[i] = b;
+			pos[b] = i;
+			order[j] = a;
+			pos[a] = j;
+		}
+	}
+
+	// replace edges (i, i+1) and (j, j+1) with (i, j) and (i+1, j+1) if that is shorter
+	bool tryTwoOpt(int i, int j)
+	{
+		if (i > j)
+			std::swap(i, j);
+		if (i < first || j + 1 > last || j - i < 2)
+			return false;
+
+		uint32_t a = order[i], b = order[i + 1], c = order[j], d = order[j + 1];
+		float gain = dist(a, b) + dist(c, d) - dist(a, c) - dist(b, d);
+		if (gain <= 1e-4f)
+			return false;
+
+		reverse(i + 1, j);
+		length -= gain;
+		push(a);
+		push(b);
+		push(c);
+		push(d);
+		return true;
+	}
+
+	bool twoOpt(uint32_t a)
+	{
+		const int p = pos[a];
+		const uint32_t* candidates = &neighbors[(size_t)a * tourNeighbors];
+
+		// new edge from a to one of its neighbors c, replacing the edge to a's successor
+		if (p < last)
+		{
+			float current = dist(a, order[p + 1]);
+			for (int k = 0; k < tourNeighbors && candidates[k] != UINT32_MAX; k++)
+			{
+				uint32_t c = candidates[k];
+				if (dist(a, c) >= current)
+					break;
+				if (owns(c) && tryTwoOpt(p, pos[c]))
+					return true;
+			}
+		}
+
+		// same again, replacing the edge to a's predecessor
+		if (p > first)
+		{
+			float current = dist(a, order[p - 1]);
+			for (int k = 0; k < tourNeighbors && candidates[k] != UINT32_MAX; k++)
+			{
+				uint32_t c = candidates[k];
+				if (dist(a, c) >= current)
+					break;
+				if (owns(c) && tryTwoOpt(p - 1, (int)pos[c] - 1))
+					return true;
 			}
+		}
+
+		return false;
+	}
+
+	// move the segment at positions [start, start + count) between positions t and t+1, reversed if that is shorter
+	bool tryMoveSegment(int start, int count, int t, float removeGain)
+	{
+		const int end = start + count - 1;
+		if (t < first || t + 1 > last || (t >= start - 1 && t <= end))
+			return false;
+
+		uint32_t s1 = order[start], s2 = order[end];
+		uint32_t u = order[t], v = order[t + 1];
+		float forward = dist(u, s1) + dist(s2, v);
+		float backward = dist(u, s2) + dist(s1, v);
+		float gain = removeGain + dist(u, v) - std::min(forward, backward);
+		if (gain <= 1e-4f)
+			return false;
+
+		push(order[start - 1]);
+		push(order[end + 1]);
+		push(u);
+		push(v);
+		push(s1);
+		push(s2);
 
-			float sum = 0;
-			for (int x = 0; x <= HalfSize; x++) {
-				if (i + x < 0 || i + x >= src.rows)	continue;
-				for (int y = -HalfSize; y <= HalfSize; y++) {
-					if (j + y < 0 || j + y >= src.cols)	continue;
-					sum += ErrorKernel_Stucki[x][y + HalfSize];
+		// the segment ends up reversed after the first two reversals
+		if (t > end)
+		{
+			reverse(start, t);
+			reverse(start, t - count);
+			if (forward < backward)
+				reverse(t - count + 1, t);
+		}
+		else
+		{
+			reverse(t + 1, end);
+			reverse(t + 1 + count, end);
+			if (forward < backward)
+				reverse(t + 1, t + count);
+		}
+		length -= gain;
+		return true;
+	}
+
+	bool orOpt(uint32_t a)
+	{
+		const int p = pos[a];
+
+		for (int count = 1; count <= orOptMaxLength; count++)
+		{
+			// segments starting at a, and ending at a
+			for (int side = 0; side < (count == 1 ? 1 : 2); side++)
+			{
+				int start = side ? p - count + 1 : p;
+				int end = start + count - 1;
+				if (start <= first || end >= last)
+					continue;
+
+				uint32_t prev = order[start - 1], next = order[end + 1];
+				uint32_t ends[2] = { order[start], order[end] };
+				float removeGain = dist(prev, ends[0]) + dist(ends[1], next) - dist(prev, next);
+				if (removeGain <= 1e-4f)
+					continue;
+
+				for (uint32_t e : ends)
+				{
+					const uint32_t* candidates = &neighbors[(size_t)e * tourNeighbors];
+					for (int k = 0; k < tourNeighbors && candidates[k] != UINT32_MAX; k++)
+					{
+						uint32_t c = candidates[k];
+						if (dist(e, c) >= removeGain)
+							break;
+						if (!owns(c))
+							continue;
+						int q = pos[c];
+						if (tryMoveSegment(start, count, q, removeGain) || tryMoveSegment(start, count, q - 1, removeGain))
+							return true;
+					}
 				}
 			}
+		}
+
+		return false;
+	}
 
-			for (int x = 0; x <= HalfSize; x++) {
-				if (i + x < 0 || i + x >= src.rows)	continue;
-				for (int y = -HalfSize; y <= HalfSize; y++) {
-					if (j + y < 0 || j + y >= src.cols)	continue;
-					if (x != 0 || y != 0)
-						tdst1f.ptr<float>(i + x)[j + y] += (error * ErrorKernel_Stucki[x][y + HalfSize] / sum);
+	// process queued nodes until none of them can be improved. Returns false if we ran out of time.
+	bool improveQueued(std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled)
+	{
+		size_t head = 0;
+		unsigned steps = 0;
+
+		while (head < work.size())
+		{
+			if ((++steps & 255) == 0)
+			{
+				if (cancelled || std::chrono::steady_clock::now() >= deadline)
+					return false;
+
+				// compact the queue so it doesn't grow without bound
+				if (head > 65536 && head * 2 > work.size())
+				{
+					work.erase(work.begin(), work.begin() + head);
+					head = 0;
 				}
 			}
+
+			uint32_t a = work[head++];
+			queued[a] = false;
+			if (twoOpt(a) || orOpt(a))
+				push(a);
 		}
+
+		work.clear();
+		return true;
 	}
 
-	tdst1f.convertTo(dst, CV_8UC1);
-	return true;
+	// double bridge on a short stretch of the tour: A B C D becomes A C B D
+	void kick()
+	{
+		const int n = last - first + 1;
+		const int maxSegment = std::min(50, (n - 2) / 3);
+		std::uniform_int_distribution<int> segment(1, std::max(1, maxSegment));
+		int lengthB = segment(random);
+		int lengthC = segment(random);
+		if (lengthB + lengthC > n - 2)
+			return;
+		std::uniform_int_distribution<int> start(first + 1, last - lengthB - lengthC);
+		int b = start(random);
+		int c = b + lengthB;
+		int end = c + lengthC - 1;
+
+		uint32_t a0 = order[b - 1], b0 = order[b], b1 = order[c - 1], c0 = order[c], c1 = order[end], d0 = order[end + 1];
+		length += dist(a0, c0) + dist(c1, b0) + dist(b1, d0) - dist(a0, b0) - dist(b1, c0) - dist(c1, d0);
+
+		reverse(b, end);
+		reverse(b, b + lengthC - 1);
+		reverse(b + lengthC, end);
+
+		push(a0);
+		push(b0);
+		push(b1);
+		push(c0);
+		push(c1);
+		push(d0);
+	}
+};
+
+// squared distance from p to the closest pixel in r
+static inline int distanceToRect(const cv::Point& p, const cv::Rect& r)
+{
+	int dx = std::max(std::max(r.x - p.x, p.x - (r.x + r.width - 1)), 0);
+	int dy = std::max(std::max(r.y - p.y, p.y - (r.y + r.height - 1)), 0);
+	return dx * dx + dy * dy;
 }
 
-// Spawn Concorde to calculate tour between all pixels
-std::vector<cv::Point> findShortestTour(Path& points)
+// A path through the points of one tile (indices into points) that starts at entry and, unless it is UINT32_MAX,
+// ends at exit: a nearest neighbor walk improved until there are no improving moves left (or time runs out).
+static Tour solveTile(const Path& points, const std::vector<uint32_t>& members, uint32_t entry, uint32_t exit,
+	std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled)
 {
-	int counter = 1;
-	ofstream f;
-	ifstream g;
-	int error;
-	Path tour;
+	Path local(members.size());
+	uint32_t first = 0, last = UINT32_MAX;
+	for (uint32_t i = 0; i < (uint32_t)members.size(); i++)
+	{
+		local.set(i, points[members[i]]);
+		if (members[i] == entry)
+			first = i;
+		if (members[i] == exit)
+			last = i;
+	}
 
-	// output file header
-	f.open("digital-daguerreotype.tsp", fstream::out);
-	f << "NAME: digital daguerreotype" << endl;
-	f << "TYPE : TSP" << endl;
-	f << "DIMENSION : " << points.size() << endl;
-	f << "EDGE_WEIGHT_TYPE : EUC_2D" << endl;
-	f << "NODE_COORD_SECTION" << endl;
+	SpatialGrid grid(local);
+	std::vector<uint32_t> neighbors = grid.nearestNeighbors(tourNeighbors);
+	Tour order = nearestNeighborTour(local, grid, first, last);
+	if (order.size() > 3)
+	{
+		TourState state(local, neighbors, order);
+		TourOptimizer optimizer(state, 0, (int)order.size() - 1);
+		optimizer.localSearch(deadline, cancelled);
+	}
 
-	// output a valid .tsp file for post processing
-	for (Path::iterator i = points.begin(); i != points.end(); ++i)
+	for (uint32_t& i : order)
+		i = members[i];
+	return order;
+}
+
+// Build a starting tour for a large point set in parallel. The frame is cut into tiles that are visited in
+// a serpentine, row by row. Going from tile to tile, the tour enters each one at its point closest to where
+// the last one was left and leaves it at its point closest to the next tile, so the tiles join up with short
+// edges. Each tile is then solved on its own as a path between those two points and the paths are joined.
+static Tour tiledTour(const Path& points, int threads, std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled)
+{
+	int minX = points[0].x, maxX = points[0].x, minY = points[0].y, maxY = points[0].y;
+	for (const cv::Point& p : points)
 	{
-		f << counter++ << " ";
-		f << (*i).x << " ";
-		f << (*i).y;
-		f << endl;
+		minX = std::min(minX, p.x);
+		maxX = std::max(maxX, p.x);
+		minY = std::min(minY, p.y);
+		maxY = std::max(maxY, p.y);
 	}
-	f.close();
+	const int width = maxX - minX + 1, height = maxY - minY + 1;
 
-	// now spawn Concorde to create a tour
-	error = system("linkern -Q -t 5 -o digital-daguerreotype.tour digital-daguerreotype.tsp");
-	if (error)
-		throw std::runtime_error("error spawning linkern");
+	// about tourPointsPerTile points in each tile and at least a tile for every thread, kept roughly square
+	const int wanted = std::max(threads, ((int)points.size() + tourPointsPerTile - 1) / tourPointsPerTile);
+	const int columns = std::max(1, std::min(width, (int)lround(sqrt((double)wanted * width / height))));
+	const int rows = std::max(1, std::min(height, (wanted + columns - 1) / columns));
+	const int tileWidth = (width + columns - 1) / columns;
+	const int tileHeight = (height + rows - 1) / rows;
+
+	// number the tiles in the order they're visited: odd rows run right to left
+	std::vector<std::vector<uint32_t>> members(rows * columns);
+	std::vector<cv::Rect> rects(rows * columns);
+	for (int r = 0; r < rows; r++)
+	{
+		for (int c = 0; c < columns; c++)
+		{
+			int k = r * columns + ((r & 1) ? columns - 1 - c : c);
+			rects[k] = cv::Rect(minX + c * tileWidth, minY + r * tileHeight, tileWidth, tileHeight);
+		}
+	}
+	for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+	{
+		int r = (points[i].y - minY) / tileHeight;
+		int c = (points[i].x - minX) / tileWidth;
+		members[r * columns + ((r & 1) ? columns - 1 - c : c)].push_back(i);
+	}
 
-	// convert the tour file to a Path and return it
-	g.open("digital-daguerreotype.tour", fstream::in);
-	if (g)
+	// skip the empty tiles
+	size_t tiles = 0;
+	for (size_t k = 0; k < members.size(); k++)
 	{
-		int count, x, y, z;
+		if (members[k].empty())
+			continue;
+		members[tiles].swap(members[k]);
+		rects[tiles++] = rects[k];
+	}
+	members.resize(tiles);
 
-		g >> count;
-		g >> z;
+	// pick where the tour enters and leaves each tile, starting from the top left corner
+	std::vector<uint32_t> entry(tiles), exit(tiles, UINT32_MAX);
+	cv::Point from(minX, minY);
+	for (size_t k = 0; k < tiles; k++)
+	{
+		int best = INT_MAX;
+		for (uint32_t i : members[k])
+		{
+			int d = (points[i].x - from.x) * (points[i].x - from.x) + (points[i].y - from.y) * (points[i].y - from.y);
+			if (d < best)
+			{
+				best = d;
+				entry[k] = i;
+			}
+		}
+		if (k + 1 == tiles)
+			break;
 
-		for (int i = 0; i < count; i++)
+		best = INT_MAX;
+		for (uint32_t i : members[k])
 		{
-			g >> x;
-			g >> y;
-			g >> z;
+			int d = distanceToRect(points[i], rects[k + 1]);
+			if (d < best && (i != entry[k] || members[k].size() == 1))
+			{
+				best = d;
+				exit[k] = i;
+			}
+		}
+		from = points[exit[k]];
+	}
+
+	// solve the tiles, biggest first so no thread is left with a big one at the end
+	std::vector<size_t> queue(tiles);
+	for (size_t k = 0; k < tiles; k++)
+		queue[k] = k;
+	std::sort(queue.begin(), queue.end(), [&members](size_t a, size_t b) { return members[a].size() > members[b].size(); });
+
+	std::vector<Tour> paths(tiles);
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.push_back(std::thread([&]()
+			{
+				for (size_t q = next++; q < tiles; q = next++)
+				{
+					size_t k = queue[q];
+					paths[k] = solveTile(points, members[k], entry[k], exit[k], deadline, cancelled);
+				}
+			}));
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	Tour order;
+	order.reserve(points.size());
+	for (const Tour& path : paths)
+		order.insert(order.end(), path.begin(), path.end());
+	return order;
+}
+
+// length of the path through the points in the given order
+static double tourLength(const Path& points, const Tour& order)
+{
+	double length = 0;
+	for (size_t i = 1; i < order.size(); i++)
+		length += pixelDistance(points.x(), points.y(), order[i - 1], order[i]);
+	return length;
+}
+
+// hand a copy of the tour to whoever is watching if it's shorter than the last one we handed over
+static void publishTour(TourSnapshots* snapshots, TspProgress* progress, const Path& points, const Tour& order, double& published)
+{
+	if (!snapshots && !progress)
+		return;
+
+	double length = tourLength(points, order);
+	if (length >= published)
+		return;
 
-			tour.push_back(points[x]);
-			tour.push_back(points[y]);
+	if (snapshots)
+	{
+		TourSnapshot& snapshot = snapshots->write_buffer();
+		snapshot.order = order;
+		snapshot.length = length;
+		snapshots->publish();
+	}
+	if (progress)
+		progress->length = length;
+	published = length;
+}
+
+// Split the tour into one stretch per thread and improve them all at once. The stretches are shifted by
+// half their length every round so the boundaries between them get improved too, and the tour is
+// published at the end of each round.
+static void optimizeInRounds(TourState& tour, int threads, std::chrono::steady_clock::time_point deadline, const std::atomic_bool& cancelled,
+	TourSnapshots* snapshots, TspProgress* progress, double& published)
+{
+	const int n = (int)tour.order.size();
+	const int stretch = n / threads;
+	tour.owner.assign(n, 0);
+
+	for (int round = 0; !cancelled; round++)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+			break;
+		auto roundDeadline = std::min(deadline, now + std::chrono::milliseconds(tourRoundMilliseconds));
+
+		// stretch t covers positions bounds[t] to bounds[t + 1], the points at the ends belong to both but never move
+		std::vector<int> bounds(threads + 1);
+		const int offset = (round & 1) ? stretch / 2 : 0;
+		bounds[0] = 0;
+		for (int t = 1; t < threads; t++)
+			bounds[t] = offset + t * stretch;
+		bounds[threads] = n - 1;
+		for (int t = 0; t < threads; t++)
+			for (int p = bounds[t]; p <= bounds[t + 1]; p++)
+				tour.owner[tour.order[p]] = t;
+
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threads; t++)
+		{
+			workers.push_back(std::thread([&tour, &bounds, &cancelled, t, threads, round, roundDeadline]()
+				{
+					TourOptimizer optimizer(tour, bounds[t], bounds[t + 1], t, round * threads + t + 1);
+					optimizer.optimize(roundDeadline, cancelled);
+				}));
 		}
+		for (std::thread& worker : workers)
+			worker.join();
 
-		g.close();
+		if (progress)
+			progress->rounds++;
+		publishTour(snapshots, progress, tour.points, tour.order, published);
 	}
 
-	return tour;
+	tour.owner.clear();
+}
+
+// Calculate a short tour between all pixels: a nearest neighbor tour improved with 2-opt and Or-opt moves
+// limited to each point's nearest neighbors, then perturbed and repaired until we run out of time.
+// Large point sets start from tiles solved in parallel instead of the nearest neighbor tour, so the time
+// to a good tour grows with the number of points rather than faster; the pass over the whole tour still
+// follows, to fix the joins between tiles. Better tours are published to snapshots (if given) as they are found,
+// and the rounds of improvement and the best length so far to progress. threads is the most threads to
+// use at once, 0 for tourThreads.
+Tour findShortestTour(const Path& points, int seconds, int threads, const std::atomic_bool& cancelled, TourSnapshots* snapshots, TspProgress* progress)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	double published = HUGE_VAL;
+	threads = coreThreads(threads > 0 ? threads : tourThreads);
+
+	SpatialGrid grid(points);
+	std::vector<uint32_t> neighbors = grid.nearestNeighbors(tourNeighbors);
+	Tour order = points.size() >= 2 * (size_t)tourPointsPerTile ? tiledTour(points, threads, deadline, cancelled) : nearestNeighborTour(points, grid);
+	publishTour(snapshots, progress, points, order, published);
+	if (points.size() > 3)
+	{
+		TourState state(points, neighbors, order);
+		threads = std::max(1, std::min(threads, (int)points.size() / tourPointsPerThread));
+
+		// the first pass fixes the long jumps in the nearest neighbor tour, which can span the whole tour,
+		// or the joins between tiles. It counts against the time allowed like the rest.
+		TourOptimizer whole(state, 0, (int)order.size() - 1);
+		whole.localSearch(deadline, cancelled);
+		publishTour(snapshots, progress, points, order, published);
+
+		optimizeInRounds(state, threads, deadline, cancelled, snapshots, progress, published);
+	}
+
+	return order;
 }
+#endif
 
+// distance along a Hilbert curve filling an n x n square (n a power of two) to the point (x, y)
+static uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// rotate the quadrant so the curve inside it runs the same way as the whole curve
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
 
-Path mat_to_tsp(cv::Mat& image, const std::atomic_bool& cancelled)
+// Order the points along a Hilbert curve. It's a long way from the shortest tour but it looks reasonable
+// and only takes a sort so we have something to show while the real tour is computed.
+Tour hilbert_tsp(const Path& points)
 {
-	Path points, tsp;
+	Tour tsp;
+	int size = 1;
+	const int16_t* x = points.x();
+	const int16_t* y = points.y();
+	for (size_t i = 0; i < points.size(); i++)
+		size = std::max(size, std::max(x[i], y[i]) + 1);
+	uint32_t n = 1;
+	while ((int)n < size)
+		n *= 2;
+
+	std::vector<std::pair<uint32_t, uint32_t>> keys(points.size());
+	for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+		keys[i] = std::make_pair(hilbertIndex(n, x[i], y[i]), i);
+	std::sort(keys.begin(), keys.end());
+
+	tsp.reserve(points.size());
+	for (const auto& key : keys)
+		tsp.push_back(key.second);
+
+	return tsp;
+}
+
+Tour points_to_tsp(const Path& points, const std::atomic_bool& cancelled, TourSnapshots* snapshots, int seconds, TspProgress* progress, int threads)
+{
+	Tour tsp;
+
+	if (points.size() < 2)
+		return tsp;
+
+	// Use TSP to find shortest continuous path between all black pixels
+	tsp = findShortestTour(points, seconds, threads, cancelled, snapshots, progress);
+
+	return tsp;
+}
 
-	// image = ImageAdjust[image, {0,0.9}] - lighten the image to blow out the face highlights
-	image.convertTo(image, -1, 2.25);
+// lighten the image and convert it to grayscale, returns false if we're cancelled along the way
+static bool lightenToGray(cv::Mat& image, const std::atomic_bool& cancelled)
+{
+	image.convertTo(image, -1, lightenGain);
 #ifdef _DEBUG
 	imshow("convertTo", image);
 #endif
 	if (cancelled)
-		return tsp;
+		return false;
 
 	// ColorConvert[image,"Grayscale"] - converts the color space of image to the specified color space colspace.
 	cvtColor(image, image, COLOR_BGR2GRAY);
 #ifdef _DEBUG
 	imshow("cvtColor", image);
 #endif
+	return !cancelled;
+}
+
+Path mat_to_points(const cv::Mat& image, const std::atomic_bool& cancelled, DitherKernel kernel, TspProgress* progress, int threads)
+{
 	if (cancelled)
-		return tsp;
+		return Path();
 
-	// Stucki halftoning processing
-	Stucki1981(image, image);
-#ifdef _DEBUG
-	imshow("Stucki1981", image);
-#endif
+	// lighten, convert to grayscale, dither (Stucki unless asked for another kernel) and collect the positions
+	// of all black pixels in one pass over the image, on every core
+	Path points = ditherToPoints(image, kernel, coreThreads(threads), progress);
 	if (cancelled)
-		return tsp;
+		return Path();
+	if (progress)
+		progress->dithered = 100;
+
+	return points;
+}
+
+Path mat_to_stipples(cv::Mat& image, int count, const std::atomic_bool& cancelled, TspProgress* progress, int threads)
+{
+	Path points;
 
-	// collect positions of all black pixels
-	points = pixelValuePositions(image, 0);
+	if (image.cols > PathMaxSize || image.rows > PathMaxSize)
+		throw std::runtime_error("[mat_to_stipples] image is too big for a Path");
+	if (!lightenToGray(image, cancelled))
+		return points;
+
+	points = stipple(image, count, coreThreads(threads), cancelled, progress);
 	if (cancelled)
-		return tsp;
-	if (points.size() < 2)
-		return tsp;
+		return Path();
+	if (progress)
+		progress->dithered = 100;
 
-	// Use TSP to find shortest continuous path between all black pixels
-	tsp = findShortestTour(points);
+	// leave the image showing the stipples
+	image.setTo(255);
+	for (const cv::Point& p : points)
+		image.ptr<uchar>(p.y)[p.x] = 0;
+#ifdef _DEBUG
+	imshow("stipple", image);
+#endif
 
-	return tsp;
+	return points;
+}
+
+Tour mat_to_tsp(const cv::Mat& image, Path& points, const std::atomic_bool& cancelled, DitherKernel kernel, TspProgress* progress, int threads)
+{
+	points = mat_to_points(image, cancelled, kernel, progress, threads);
+	if (cancelled)
+		return Tour();
+
+	return points_to_tsp(points, cancelled, nullptr, 5, progress, threads);
 }
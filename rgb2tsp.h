@@ -2,10 +2,141 @@
 // Background thread processing of RGB image into <vector> of points in TSP order
 //
 
+#pragma once
+
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <atomic>
+#include <cstdint>
+#include "triplebuffer.h"
+
+// Pixel positions, with the x and y coordinates kept in separate arrays of 16 bit values. That is plenty
+// for any camera image and halves what the tour solver reads compared to cv::Point; distances between
+// points can be worked out straight from the arrays. Points go in and come out as cv::Point.
+class Path
+{
+public:
+	class const_iterator
+	{
+	public:
+		const_iterator(const Path& points, size_t i) : points(&points), i(i) {}
+		cv::Point operator*() const { return (*points)[i]; }
+		const_iterator& operator++() { ++i; return *this; }
+		bool operator==(const const_iterator& other) const { return i == other.i; }
+		bool operator!=(const const_iterator& other) const { return i != other.i; }
+
+	private:
+		const Path* points;
+		size_t i;
+	};
+
+	Path() {}
+	explicit Path(size_t count) : xs(count), ys(count) {}
+
+	size_t size() const { return xs.size(); }
+	bool empty() const { return xs.empty(); }
+	void reserve(size_t count) { xs.reserve(count); ys.reserve(count); }
+	void clear() { xs.clear(); ys.clear(); }
+
+	const cv::Point operator[](size_t i) const { return cv::Point(xs[i], ys[i]); }
+	const cv::Point back() const { return (*this)[size() - 1]; }
+	void set(size_t i, const cv::Point& p) { xs[i] = (int16_t)p.x; ys[i] = (int16_t)p.y; }
+	void push_back(const cv::Point& p) { xs.push_back((int16_t)p.x); ys.push_back((int16_t)p.y); }
+	void assign(size_t count, const cv::Point& p) { xs.assign(count, (int16_t)p.x); ys.assign(count, (int16_t)p.y); }
+
+	// add count points of other starting from first
+	void append(const Path& other, size_t first, size_t count)
+	{
+		xs.insert(xs.end(), other.xs.begin() + first, other.xs.begin() + first + count);
+		ys.insert(ys.end(), other.ys.begin() + first, other.ys.begin() + first + count);
+	}
+
+	const int16_t* x() const { return xs.data(); }
+	const int16_t* y() const { return ys.data(); }
+
+	const_iterator begin() const { return const_iterator(*this, 0); }
+	const_iterator end() const { return const_iterator(*this, size()); }
+
+private:
+	std::vector<int16_t> xs, ys;
+};
+
+// the largest width or height of an image whose pixels fit in a Path
+const int PathMaxSize = INT16_MAX + 1;
+
+// A tour is the order to visit the points of a Path in, as indexes into it
+typedef std::vector<uint32_t> Tour;
+
+// The points of a Path in the order a Tour visits them, each one once
+class TourView
+{
+public:
+	class const_iterator
+	{
+	public:
+		const_iterator(const Path& points, Tour::const_iterator i) : points(&points), i(i) {}
+		cv::Point operator*() const { return (*points)[*i]; }
+		const_iterator& operator++() { ++i; return *this; }
+		bool operator==(const const_iterator& other) const { return i == other.i; }
+		bool operator!=(const const_iterator& other) const { return i != other.i; }
+
+	private:
+		const Path* points;
+		Tour::const_iterator i;
+	};
+
+	TourView(const Path& points, const Tour& tour) : points(points), tour(tour) {}
+
+	const_iterator begin() const { return const_iterator(points, tour.begin()); }
+	const_iterator end() const { return const_iterator(points, tour.end()); }
+	size_t size() const { return tour.size(); }
+	bool empty() const { return tour.empty(); }
+	cv::Point operator[](size_t i) const { return points[tour[i]]; }
+
+private:
+	const Path& points;
+	const Tour& tour;
+};
+
+// A tour and how long it is
+struct TourSnapshot
+{
+	Tour order;
+	double length;
+};
+typedef TripleBuffer<TourSnapshot> TourSnapshots;
+
+// How far a conversion has got, filled in as it goes so another thread can show it
+struct TspProgress
+{
+	TspProgress() : dithered(0), rounds(0), length(0) {}
+
+	std::atomic<int> dithered;		// percent of the dithering (or stippling) done
+	std::atomic<int> rounds;		// rounds of improvement the solver has made to the tour
+	std::atomic<double> length;		// length in pixels of the best tour so far, 0 until there is one
+};
+
+// Error diffusion kernels mat_to_points can dither with. Atkinson only spreads 3/4 of the error, so nearly
+// white (or black) areas come out all white (or black) instead of speckled. BlueNoise isn't error diffusion
+// but a threshold per pixel from a tiled blue noise mask: grainier, but every pixel is done independently
+// so it takes a fraction of the time.
+enum class DitherKernel { Stucki, Atkinson, JarvisJudiceNinke, FloydSteinberg, BlueNoise };
+
+// dither the image and return the positions of its black pixels, the image is left as it is. threads (and
+// the threads arguments below) limits how many threads are used, 0 for one per core.
+extern Path mat_to_points(const cv::Mat& image, const std::atomic_bool& cancelled, DitherKernel kernel = DitherKernel::Stucki, TspProgress* progress = nullptr, int threads = 0);
+
+// alternative to mat_to_points that places about count points (fewer if some share a pixel) by weighted
+// Voronoi stippling, so the time to solve and draw a picture doesn't depend on how dark it is
+extern Path mat_to_stipples(cv::Mat& image, int count, const std::atomic_bool& cancelled, TspProgress* progress = nullptr, int threads = 0);
+
+// quick tour through the points along a Hilbert curve, for previewing while points_to_tsp runs
+extern Tour hilbert_tsp(const Path& points);
 
-typedef std::vector<cv::Point> Path;
+// shortest tour we can find through the points in the time allowed. Each time a shorter tour is found
+// it is published to snapshots so it can be shown, or used if we don't want to wait for the rest. The
+// rounds of improvement and the best length so far go to progress.
+extern Tour points_to_tsp(const Path& points, const std::atomic_bool& cancelled, TourSnapshots* snapshots = nullptr, int seconds = 5, TspProgress* progress = nullptr, int threads = 0);
 
-extern Path mat_to_tsp(cv::Mat& image, const std::atomic_bool& cancelled);
+// mat_to_points followed by points_to_tsp
+extern Tour mat_to_tsp(const cv::Mat& image, Path& points, const std::atomic_bool& cancelled, DitherKernel kernel = DitherKernel::Stucki, TspProgress* progress = nullptr, int threads = 0);
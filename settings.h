@@ -0,0 +1,39 @@
+//
+// Settings shared by the booth and daguerreotype-batch, so a picture is drawn the same whichever made it
+//
+
+#pragma once
+
+#include "rgb2tsp.h"
+#include "gcode.h"
+
+// The input width/height should be less than the screen and camera resolution
+const int inputWidthPixels = 640;
+const int inputHeightPixels = 480;
+
+// Large Etch-A-Sketch screen size is 160 mm x 110 mm (600 x 420 pixels - roughly 3:2 ratio)
+// Printable area on 8.5" / 11" paper is 250 mm x 180 mm
+// The output width/height ratio should be the same as the input ratio to prevent warping the image
+const int outputWidthMM = 250;
+const int outputHeightMM = 187;
+
+// Points closer than half the pen width to the line drawn without them are left out, and the path is
+// simplified this many points at a time as it is sent
+const float penWidthMM = 0.4f;
+const size_t simplifyWindow = 512;
+
+// How long to keep improving the tour if 'draw' isn't pressed first (and in daguerreotype-batch unless -s
+// says otherwise)
+const int tourSeconds = 30;
+
+// The error diffusion kernel to dither with. Atkinson only spreads 3/4 of the error, blowing out more of the
+// highlights and shadows; Floyd-Steinberg and Atkinson are the quickest. BlueNoise thresholds against a blue
+// noise mask instead, which is grainier but takes well under a millisecond.
+const DitherKernel ditherKernel = DitherKernel::Stucki;
+
+// Place this many points by stippling instead of using every pixel the dithering turns black (0 to dither).
+// A fixed number of points keeps the time to solve and draw every picture about the same: 8000 is a good start.
+const int stipplePoints = 0;
+
+// Where the picture goes on the paper and how the path is simplified, from the settings above
+const GcodeLayout drawingLayout = { cv::Size(inputWidthPixels, inputHeightPixels), cv::Size2f((float)outputWidthMM, (float)outputHeightMM), penWidthMM, simplifyWindow };
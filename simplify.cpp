@@ -0,0 +1,81 @@
+//
+// Thinning out a path before it is drawn
+//
+#include "simplify.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// squared distance from p to the segment a-b
+static float segmentDistance(const cv::Point2f& p, const cv::Point2f& a, const cv::Point2f& b)
+{
+	const float dx = b.x - a.x, dy = b.y - a.y;
+	const float length = dx * dx + dy * dy;
+	float t = length > 0 ? ((p.x - a.x) * dx + (p.y - a.y) * dy) / length : 0;
+	t = std::min(std::max(t, 0.f), 1.f);
+	const float ex = a.x + t * dx - p.x, ey = a.y + t * dy - p.y;
+	return ex * ex + ey * ey;
+}
+
+Path simplify_path(const Path& path, const cv::Point2f& scale, float tolerance)
+{
+	if (path.size() < 3)
+		return path;
+
+	// a point in the middle of a straight run adds nothing, unless the path turns back on itself there
+	Path straight;
+	straight.reserve(path.size());
+	straight.push_back(path[0]);
+	for (size_t i = 1; i + 1 < path.size(); i++)
+	{
+		const cv::Point& a = straight.back();
+		const cv::Point& b = path[i];
+		const cv::Point& c = path[i + 1];
+		const int cross = (b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x);
+		const int dot = (b.x - a.x) * (c.x - b.x) + (b.y - a.y) * (c.y - b.y);
+		if (cross != 0 || dot <= 0)
+			straight.push_back(b);
+	}
+	straight.push_back(path.back());
+
+	// Ramer-Douglas-Peucker in output units: keep the point furthest from the line between the ends of
+	// a stretch if it is further than tolerance and split the stretch there, otherwise drop everything between
+	std::vector<cv::Point2f> scaled(straight.size());
+	for (size_t i = 0; i < straight.size(); i++)
+		scaled[i] = cv::Point2f(straight[i].x * scale.x, straight[i].y * scale.y);
+
+	std::vector<bool> keep(straight.size(), false);
+	keep.front() = keep.back() = true;
+	std::vector<std::pair<size_t, size_t>> stretches(1, std::make_pair((size_t)0, straight.size() - 1));
+	const float limit = tolerance * tolerance;
+	while (!stretches.empty())
+	{
+		const size_t first = stretches.back().first, last = stretches.back().second;
+		stretches.pop_back();
+
+		size_t furthest = first;
+		float distance = limit;
+		for (size_t i = first + 1; i < last; i++)
+		{
+			float d = segmentDistance(scaled[i], scaled[first], scaled[last]);
+			if (d > distance)
+			{
+				distance = d;
+				furthest = i;
+			}
+		}
+		if (furthest == first)
+			continue;
+
+		keep[furthest] = true;
+		stretches.push_back(std::make_pair(first, furthest));
+		stretches.push_back(std::make_pair(furthest, last));
+	}
+
+	Path simplified;
+	for (size_t i = 0; i < straight.size(); i++)
+		if (keep[i])
+			simplified.push_back(straight[i]);
+	return simplified;
+}
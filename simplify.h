@@ -0,0 +1,12 @@
+//
+// Thinning out a path before it is drawn
+//
+
+#pragma once
+
+#include "rgb2tsp.h"
+
+// Drop the points of a path the pen would draw no differently without: first the middle points of straight
+// runs, then (Ramer-Douglas-Peucker) any point within tolerance of the line drawn without it. scale converts
+// pixels to the units tolerance is given in, so it can be set from the pen width. The ends are always kept.
+extern Path simplify_path(const Path& path, const cv::Point2f& scale, float tolerance);
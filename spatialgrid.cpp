@@ -0,0 +1,185 @@
+//
+// Bucket grid over the pixel lattice for nearest neighbor queries between the points of a Path
+//
+#include "spatialgrid.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+SpatialGrid::SpatialGrid(const Path& points, int cellSize)
+	: points(points), cellSize(cellSize), minX(0), minY(0), columns(1), rows(1), live(points.size())
+{
+	// the coordinates are read straight from the path's arrays rather than as cv::Points
+	const int16_t* xs = points.x();
+	const int16_t* ys = points.y();
+	const uint32_t count = (uint32_t)points.size();
+
+	int maxX = 0, maxY = 0;
+	if (count)
+	{
+		minX = maxX = xs[0];
+		minY = maxY = ys[0];
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		minX = std::min(minX, (int)xs[i]);
+		maxX = std::max(maxX, (int)xs[i]);
+		minY = std::min(minY, (int)ys[i]);
+		maxY = std::max(maxY, (int)ys[i]);
+	}
+
+	// aim for about two points per cell
+	if (this->cellSize <= 0)
+	{
+		double area = (double)(maxX - minX + 1) * (maxY - minY + 1);
+		this->cellSize = std::max(1, (int)sqrt(2.0 * area / std::max<size_t>(points.size(), 1)));
+	}
+	columns = (maxX - minX) / this->cellSize + 1;
+	rows = (maxY - minY) / this->cellSize + 1;
+
+	// counting sort of the points into their cells
+	const size_t cells = (size_t)columns * rows;
+	cellStart.assign(cells + 1, 0);
+	for (uint32_t i = 0; i < count; i++)
+		cellStart[cellOf(xs[i], ys[i]) + 1]++;
+	for (size_t c = 0; c < cells; c++)
+		cellStart[c + 1] += cellStart[c];
+
+	cellLive.resize(cells);
+	for (size_t c = 0; c < cells; c++)
+		cellLive[c] = cellStart[c + 1] - cellStart[c];
+
+	items.resize(count);
+	slot.resize(count);
+	std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t s = fill[cellOf(xs[i], ys[i])]++;
+		items[s] = i;
+		slot[i] = s;
+	}
+}
+
+std::vector<uint32_t> SpatialGrid::nearestNeighbors(int k) const
+{
+	std::vector<uint32_t> neighbors(points.size() * k, UINT32_MAX);
+	std::vector<int> bestDistance(k);
+	const int16_t* xs = points.x();
+	const int16_t* ys = points.y();
+
+	for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+	{
+		const int px = xs[i], py = ys[i];
+		const int cx = (px - minX) / cellSize;
+		const int cy = (py - minY) / cellSize;
+		uint32_t* best = &neighbors[(size_t)i * k];
+		int found = 0;
+
+		// search rings of cells around the point's cell until the ring is further away than the k'th closest point
+		for (int r = 0; r <= std::max(columns, rows); r++)
+		{
+			if (found == k && bestDistance[k - 1] <= (r - 1) * (r - 1) * cellSize * cellSize)
+				break;
+
+			for (int y = std::max(cy - r, 0); y <= std::min(cy + r, rows - 1); y++)
+			{
+				// only the first and last row of the ring are complete, the others just have their two ends
+				int step = (y == cy - r || y == cy + r) ? 1 : 2 * r;
+				for (int x = cx - r; x <= cx + r; x += std::max(step, 1))
+				{
+					if (x < 0 || x >= columns)
+						continue;
+
+					const int cell = y * columns + x;
+					for (uint32_t s = cellStart[cell]; s < cellStart[cell + 1]; s++)
+					{
+						uint32_t c = items[s];
+						if (c == i)
+							continue;
+						int dx = xs[c] - px, dy = ys[c] - py;
+						int d = dx * dx + dy * dy;
+						if (found == k && d >= bestDistance[k - 1])
+							continue;
+
+						// insertion sort into the list of closest points
+						int n = (found < k) ? found++ : k - 1;
+						while (n > 0 && bestDistance[n - 1] > d)
+						{
+							bestDistance[n] = bestDistance[n - 1];
+							best[n] = best[n - 1];
+							n--;
+						}
+						bestDistance[n] = d;
+						best[n] = c;
+					}
+				}
+			}
+		}
+	}
+
+	return neighbors;
+}
+
+uint32_t SpatialGrid::nearest(const cv::Point& p) const
+{
+	if (live == 0)
+		return UINT32_MAX;
+
+	const int cx = std::min(std::max((p.x - minX) / cellSize, 0), columns - 1);
+	const int cy = std::min(std::max((p.y - minY) / cellSize, 0), rows - 1);
+	uint32_t best = UINT32_MAX;
+	int bestDistance = INT_MAX;
+	const int16_t* xs = points.x();
+	const int16_t* ys = points.y();
+
+	for (int r = 0; r <= std::max(columns, rows); r++)
+	{
+		// nothing in this ring or beyond can beat what we already have
+		if (best != UINT32_MAX && bestDistance <= (r - 1) * (r - 1) * cellSize * cellSize)
+			break;
+
+		for (int y = std::max(cy - r, 0); y <= std::min(cy + r, rows - 1); y++)
+		{
+			int step = (y == cy - r || y == cy + r) ? 1 : 2 * r;
+			for (int x = cx - r; x <= cx + r; x += std::max(step, 1))
+			{
+				if (x < 0 || x >= columns)
+					continue;
+
+				const int cell = y * columns + x;
+				const uint32_t end = cellStart[cell] + cellLive[cell];
+				for (uint32_t s = cellStart[cell]; s < end; s++)
+				{
+					uint32_t c = items[s];
+					int dx = xs[c] - p.x, dy = ys[c] - p.y;
+					int d = dx * dx + dy * dy;
+					if (d < bestDistance)
+					{
+						bestDistance = d;
+						best = c;
+					}
+				}
+			}
+		}
+	}
+
+	return best;
+}
+
+void SpatialGrid::remove(uint32_t i)
+{
+	const int cell = cellOf(points.x()[i], points.y()[i]);
+	const uint32_t s = slot[i];
+	const uint32_t end = cellStart[cell] + cellLive[cell];
+	if (s >= end)
+		return;
+
+	// swap the point with the last live point in its cell
+	uint32_t last = items[end - 1];
+	items[s] = last;
+	slot[last] = s;
+	items[end - 1] = i;
+	slot[i] = end - 1;
+	cellLive[cell]--;
+	live--;
+}
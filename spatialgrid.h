@@ -0,0 +1,41 @@
+//
+// Bucket grid over the pixel lattice for nearest neighbor queries between the points of a Path
+//
+
+#pragma once
+
+#include "rgb2tsp.h"
+#include <cstdint>
+#include <vector>
+
+class SpatialGrid
+{
+public:
+	// buckets the points in linear time. With cellSize 0 a size is picked that holds a couple of points per cell.
+	SpatialGrid(const Path& points, int cellSize = 0);
+
+	// the k nearest points to every point, closest first, as one flat array of k entries per point.
+	// Points with fewer than k others get their list padded with UINT32_MAX. Removed points are included.
+	std::vector<uint32_t> nearestNeighbors(int k) const;
+
+	// the closest point to p that hasn't been removed, or UINT32_MAX if there are none left
+	uint32_t nearest(const cv::Point& p) const;
+
+	// drop a point from future nearest() queries
+	void remove(uint32_t i);
+
+	size_t remaining() const { return live; }
+
+private:
+	const Path& points;
+	int cellSize;
+	int minX, minY;
+	int columns, rows;
+	std::vector<uint32_t> cellStart;	// first entry in items for each cell, plus one past the end
+	std::vector<uint32_t> cellLive;		// the first cellLive entries of a cell haven't been removed
+	std::vector<uint32_t> items;		// point indices grouped by cell
+	std::vector<uint32_t> slot;			// where each point is in items
+	size_t live;
+
+	int cellOf(int x, int y) const { return ((y - minY) / cellSize) * columns + (x - minX) / cellSize; }
+};
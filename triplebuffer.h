@@ -0,0 +1,43 @@
+//
+// Lock-free hand off of the latest value from one thread to another
+//
+
+#pragma once
+
+#include <atomic>
+
+// One thread writes values and another reads the latest one, without either ever waiting on the other.
+// The writer fills in its slot and swaps it with the middle slot; the reader swaps its slot with the
+// middle one when it holds something new. Values the reader never got around to are dropped.
+template <class T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : state(1), back(0), front(2) {}
+
+	// writer: the value to fill in before calling publish()
+	T& write_buffer() { return slots[back]; }
+
+	// writer: make the value just filled in the latest one
+	void publish() { back = state.exchange(back | fresh) & index; }
+
+	// reader: pick up the latest value if one was published since the last call. Returns true if so.
+	bool update()
+	{
+		if (!(state.load() & fresh))
+			return false;
+		front = state.exchange(front) & index;
+		return true;
+	}
+
+	// reader: the value picked up by the last update()
+	T& read_buffer() { return slots[front]; }
+
+private:
+	enum { index = 3, fresh = 4 };
+
+	T slots[3];
+	std::atomic<int> state;		// index of the middle slot, plus the fresh flag once the writer has put something new there
+	int back;					// only touched by the writer
+	int front;					// only touched by the reader
+};
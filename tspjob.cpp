@@ -0,0 +1,130 @@
+//
+// Turning captured images into tours on threads of their own, so the user interface never waits on them
+//
+#include "tspjob.h"
+#include <algorithm>
+#include <cmath>
+
+TspJob::TspJob(const cv::Mat& image, DitherKernel kernel, int stipplePoints, int seconds)
+	: source(image.clone()), kernel(kernel), stipplePoints(stipplePoints), seconds(seconds), cancelled(false), current(JobStage::queued)
+{
+}
+
+void TspJob::run()
+{
+	try
+	{
+		if (!cancelled)
+		{
+			current = JobStage::dithering;
+
+			// stippling leaves the stipples in the image it's given, so give it a copy
+			if (stipplePoints)
+			{
+				cv::Mat gray = source.clone();
+				found = mat_to_stipples(gray, stipplePoints, cancelled, &status);
+			}
+			else
+				found = mat_to_points(source, cancelled, kernel, &status);
+		}
+
+		if (found.size() >= 2 && !cancelled)
+		{
+			// something to look at while the real tour is computed
+			TourSnapshot& preview = tours.write_buffer();
+			preview.order = hilbert_tsp(found);
+			preview.length = 0;
+			for (size_t i = 1; i < preview.order.size(); i++)
+			{
+				cv::Point step = found[preview.order[i]] - found[preview.order[i - 1]];
+				preview.length += sqrt((double)step.x * step.x + (double)step.y * step.y);
+			}
+			tours.publish();
+
+			current = JobStage::solving;
+			best = points_to_tsp(found, cancelled, &tours, seconds, &status);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		failure = e.what();
+		best.clear();
+	}
+
+	current = JobStage::finished;
+}
+
+double points_difference(const Path& a, const Path& b, const cv::Size& size, int blockSize)
+{
+	const int columns = (size.width + blockSize - 1) / blockSize;
+	const int rows = (size.height + blockSize - 1) / blockSize;
+	if (columns <= 0 || rows <= 0)
+		return 0;
+
+	// black pixels of a in each block less those of b
+	std::vector<int> blocks((size_t)columns * rows, 0);
+	for (cv::Point p : a)
+		blocks[(size_t)(p.y / blockSize) * columns + p.x / blockSize]++;
+	for (cv::Point p : b)
+		blocks[(size_t)(p.y / blockSize) * columns + p.x / blockSize]--;
+
+	double difference = 0;
+	for (int count : blocks)
+		difference += abs(count);
+	return difference / ((double)size.width * size.height);
+}
+
+JobExecutor::JobExecutor(int workers)
+	: stopping(false)
+{
+	for (int t = 0; t < std::max(1, workers); t++)
+		this->workers.push_back(std::thread(&JobExecutor::work, this));
+}
+
+JobExecutor::~JobExecutor()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		for (const std::shared_ptr<TspJob>& job : waiting)
+			job->cancel();
+		for (const std::shared_ptr<TspJob>& job : running)
+			job->cancel();
+	}
+	wake.notify_all();
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+void JobExecutor::submit(const std::shared_ptr<TspJob>& job)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		waiting.push_back(job);
+	}
+	wake.notify_one();
+}
+
+// take the oldest waiting job and run it, until we're told to stop. Jobs cancelled while they were
+// waiting still go through run() so they end up finished.
+void JobExecutor::work()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		wake.wait(guard, [this]() { return stopping || !waiting.empty(); });
+		if (waiting.empty())
+			return;
+
+		std::shared_ptr<TspJob> job = waiting.front();
+		waiting.pop_front();
+		running.push_back(job);
+		guard.unlock();
+
+		job->run();
+
+		guard.lock();
+		running.erase(std::find(running.begin(), running.end(), job));
+	}
+}
@@ -0,0 +1,96 @@
+//
+// Turning captured images into tours on threads of their own, so the user interface never waits on them
+//
+
+#pragma once
+
+#include "rgb2tsp.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What a job is doing, in the order it does it
+enum class JobStage { queued, dithering, solving, finished };
+
+// One image to turn into a tour. Its stage, its progress and each better tour it finds can all be
+// watched from another thread while it runs, and it can be cancelled on its own without touching any
+// other job.
+class TspJob
+{
+public:
+	// dither the image with kernel (or stipple it if stipplePoints isn't 0) and solve it for up to seconds
+	TspJob(const cv::Mat& image, DitherKernel kernel, int stipplePoints, int seconds);
+
+	// ask the job to stop as soon as it can. A job stopped while solving finishes with the best tour so far.
+	void cancel() { cancelled = true; }
+
+	JobStage stage() const { return current; }
+	bool finished() const { return current == JobStage::finished; }
+
+	// percent dithered, rounds solved and the best length so far
+	const TspProgress& progress() const { return status; }
+
+	// a quick preview along a Hilbert curve followed by each better tour the solver finds
+	TourSnapshots& snapshots() { return tours; }
+
+	// the image the job was made from, its points (once it's solving) and its tour (once it's finished)
+	const cv::Mat& image() const { return source; }
+	const Path& points() const { return found; }
+	const Tour& tour() const { return best; }
+
+	// what went wrong if the job finished without a tour because of an error
+	const std::string& error() const { return failure; }
+
+	// does the job, on whichever thread calls it
+	void run();
+
+private:
+	TspJob(const TspJob&) = delete;
+	TspJob& operator=(const TspJob&) = delete;
+
+	const cv::Mat source;
+	const DitherKernel kernel;
+	const int stipplePoints;
+	const int seconds;
+
+	std::atomic_bool cancelled;
+	std::atomic<JobStage> current;
+	TspProgress status;
+	TourSnapshots tours;
+	Path found;
+	Tour best;
+	std::string failure;
+};
+
+// How different two sets of points look, from 0 (the same) to 1 (one all black, the other all white).
+// Noise moves single dithered pixels around, so instead of comparing pixels this compares how much of
+// each blockSize x blockSize block of the size x size picture is black.
+extern double points_difference(const Path& a, const Path& b, const cv::Size& size, int blockSize = 16);
+
+// Runs the jobs submitted to it on a few threads of its own, oldest first
+class JobExecutor
+{
+public:
+	explicit JobExecutor(int workers = 1);
+
+	// cancels every job that is waiting or running and waits for the workers to stop
+	~JobExecutor();
+
+	void submit(const std::shared_ptr<TspJob>& job);
+
+private:
+	JobExecutor(const JobExecutor&) = delete;
+	JobExecutor& operator=(const JobExecutor&) = delete;
+	void work();
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::shared_ptr<TspJob>> waiting;
+	std::vector<std::shared_ptr<TspJob>> running;
+	std::vector<std::thread> workers;
+	bool stopping;
+};